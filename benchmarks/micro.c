@@ -0,0 +1,389 @@
+// micro benchmarks for the hash table, string hashing and interning, the
+// scanner and the compiler, measured in isolation from dispatch. every
+// table operation is swept over growing key counts with keys visited in
+// random order, so the curve shows where the table stops fitting into the
+// caches.
+//
+//   clox_micro [--keys 1024,65536,...] [--delete-ratio 0.5] [--churn N]
+//              [--strings N] [--source-kb N]
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "table.h"
+#include "vm.h"
+
+#define MIN_OPS (1 << 20) // repeat small sweeps until this many operations ran
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static uint64_t g_random = 0x9e3779b97f4a7c15u;
+
+static uint64_t next_random()
+{
+  g_random ^= g_random << 13;
+  g_random ^= g_random >> 7;
+  g_random ^= g_random << 17;
+  return g_random;
+}
+
+static void shuffle(int* order, int count)
+{
+  for (int i = 0; i < count; i++) order[i] = i;
+  for (int i = count - 1; i > 0; i--)
+  {
+    int j = (int)(next_random() % (uint64_t)(i + 1));
+    int swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+}
+
+// the collector can't see these arrays. the strings are rooted on the vm
+// stack until they are out of the nursery, main() puts off major
+// collections so nothing frees them afterwards
+#define PIN_BATCH 4096
+
+static obj_string** make_keys(const char* prefix, int count)
+{
+  obj_string** keys = malloc(sizeof(obj_string*) * count);
+  char buffer[32];
+  for (int start = 0; start < count; start += PIN_BATCH)
+  {
+    int end = start + PIN_BATCH < count ? start + PIN_BATCH : count;
+    for (int i = start; i < end; i++)
+    {
+      int length = snprintf(buffer, sizeof(buffer), "%s%d", prefix, i);
+      push(OBJ_VAL(copy_string(buffer, length)));
+    }
+#ifdef GENERATIONAL_GC
+    collect_young();
+#endif
+    for (int i = end - 1; i >= start; i--) keys[i] = AS_STRING(pop());
+  }
+  return keys;
+}
+
+// ns per operation for `ops` operations cycling through `order`
+#define TIMED(ops, count, body) \
+  do { \
+    double start = now(); \
+    for (int op = 0; op < (ops); op++) { \
+      int i = order[op % (count)]; \
+      body; \
+    } \
+    ns = (now() - start) / (ops); \
+  } while (0)
+
+static void bench_table(int count, double delete_ratio, const char* separator)
+{
+  obj_string** keys = make_keys("key", count);
+  obj_string** missing = make_keys("miss", count);
+  int* order = malloc(sizeof(int) * count);
+  shuffle(order, count);
+  int ops = count < MIN_OPS ? MIN_OPS : count;
+  int deletes = (int)(count * delete_ratio);
+  volatile int sink = 0;
+  value v;
+  double ns;
+
+  // inserting measures a fresh table every round so growth is included
+  double start = now();
+  int rounds = 0;
+  table t;
+  do
+  {
+    if (rounds > 0) free_table(&t);
+    init_table(&t);
+    for (int i = 0; i < count; i++) table_set(&t, keys[order[i]], NUMBER_VAL(i));
+    rounds++;
+  } while (rounds * count < ops);
+  double set_ns = (now() - start) / ((double)rounds * count);
+
+  TIMED(ops, count, sink += table_get(&t, keys[i], &v));
+  double hit_ns = ns;
+  TIMED(ops, count, sink += table_get(&t, missing[i], &v));
+  double miss_ns = ns;
+  TIMED(ops, count,
+        sink += table_find_string(&t, keys[i]->chars, keys[i]->length, keys[i]->hash) != NULL);
+  double find_ns = ns;
+
+  start = now();
+  for (int i = 0; i < deletes; i++) table_delete(&t, keys[order[i]]);
+  double delete_ns = deletes > 0 ? (now() - start) / deletes : 0;
+  TIMED(ops, count, sink += table_get(&t, keys[i], &v));
+  double after_delete_ns = ns;
+
+  printf("%s\n    {\"keys\": %d, \"set_ns\": %.2f, \"get_hit_ns\": %.2f, \"get_miss_ns\": %.2f, "
+         "\"find_string_ns\": %.2f, \"delete_ns\": %.2f, \"get_after_delete_ns\": %.2f}",
+         separator, count, set_ns, hit_ns, miss_ns, find_ns, delete_ns, after_delete_ns);
+  fflush(stdout);
+
+  free_table(&t);
+  free(order);
+  free(keys);
+  free(missing);
+}
+
+// a sliding window of `count` keys: every insert deletes the key that
+// went in `count` inserts ago. tombstones pile up all the time, the
+// table should neither slow down nor keep growing. afterwards all but a
+// sixteenth of the keys go and the next insert should shrink the table
+static void bench_churn(int count)
+{
+  int total = count * 8;
+  obj_string** keys = make_keys("churn", total);
+  obj_string** missing = make_keys("gone", count);
+  int* order = malloc(sizeof(int) * count);
+  shuffle(order, count);
+  volatile int sink = 0;
+  value v;
+  double ns;
+
+  table t;
+  init_table(&t);
+  for (int i = 0; i < count; i++) table_set(&t, keys[i], NUMBER_VAL(i));
+  int peak = t.capacity;
+  double start = now();
+  for (int i = count; i < total; i++)
+  {
+    table_delete(&t, keys[i - count]);
+    table_set(&t, keys[i], NUMBER_VAL(i));
+    if (t.capacity > peak) peak = t.capacity;
+  }
+  double churn_ns = (now() - start) / (total - count);
+  int tombstones = t.tombstones;
+  TIMED(MIN_OPS, count, sink += table_get(&t, missing[i], &v));
+  double miss_ns = ns;
+
+  for (int i = total - count; i < total - count / 16; i++) table_delete(&t, keys[i]);
+  int drained = t.capacity;
+  table_set(&t, keys[0], NIL_VAL);
+
+  printf("  \"churn\": {\"keys\": %d, \"churn_ns\": %.2f, \"get_miss_ns\": %.2f, "
+         "\"tombstones\": %d, \"peak_capacity\": %d, \"drained_capacity\": %d, "
+         "\"shrunk_capacity\": %d},\n",
+         count, churn_ns, miss_ns, tombstones, peak, drained, t.capacity);
+  free_table(&t);
+  free(order);
+  free(keys);
+  free(missing);
+}
+
+// the strings are numbered, going through them in that order would let a
+// hash that keeps similar keys close look better than it is
+static void bench_interning(int count)
+{
+  char* chars = malloc((size_t)count * 16);
+  for (int i = 0; i < count; i++) snprintf(chars + (size_t)i * 16, 16, "s%010d", i);
+  int* order = malloc(sizeof(int) * count);
+  shuffle(order, count);
+
+  double start = now();
+  for (int i = 0; i < count; i++) copy_string(chars + (size_t)order[i] * 16, 11);
+  double new_ns = (now() - start) / count;
+
+  // most of them were collected again, keep them all for the hits
+  for (int begin = 0; begin < count; begin += PIN_BATCH)
+  {
+    int end = begin + PIN_BATCH < count ? begin + PIN_BATCH : count;
+    for (int i = begin; i < end; i++) push(OBJ_VAL(copy_string(chars + (size_t)i * 16, 11)));
+#ifdef GENERATIONAL_GC
+    collect_young();
+#endif
+    for (int i = begin; i < end; i++) pop();
+  }
+
+  start = now();
+  for (int i = 0; i < count; i++) copy_string(chars + (size_t)order[i] * 16, 11);
+  double hit_ns = (now() - start) / count;
+
+  uint64_t probes[16] = {0};
+  table_probe_lengths(&g_vm.strings, probes, 16);
+  printf("  \"interning\": {\"strings\": %d, \"new_ns\": %.2f, \"hit_ns\": %.2f, \"probe_lengths\": [",
+         count, new_ns, hit_ns);
+  for (int i = 0; i < 16; i++) printf("%s%llu", i == 0 ? "" : ", ", (unsigned long long)probes[i]);
+  printf("]},\n");
+  free(order);
+  free(chars);
+}
+
+// hash_string() alone over keys of growing length, the keys rotate through
+// a buffer so consecutive calls don't see the same bytes
+static void bench_hashing()
+{
+  static const int lengths[] = { 4, 8, 16, 32, 64, 256, 4096 };
+  char* buffer = malloc(64 * 1024 + 4096);
+  for (int i = 0; i < 64 * 1024 + 4096; i++) buffer[i] = (char)('a' + next_random() % 26);
+  volatile uint32_t sink = 0;
+  printf("  \"hashing\": [");
+  for (int l = 0; l < (int)(sizeof(lengths) / sizeof(lengths[0])); l++)
+  {
+    int length = lengths[l];
+    int ops = (64 << 20) / length < MIN_OPS ? (64 << 20) / length : MIN_OPS;
+    double start = now();
+    for (int op = 0; op < ops; op++) sink += hash_string(buffer + (op * 64) % (64 * 1024), length);
+    double ns = (now() - start) / ops;
+    printf("%s\n    {\"length\": %d, \"ns\": %.2f, \"gb_per_s\": %.2f}",
+           l == 0 ? "" : ",", length, ns, length / ns);
+  }
+  printf("\n  ],\n");
+  free(buffer);
+}
+
+// a few kinds of lines repeated with varying names and literals. the
+// commented variant adds a comment line and a longer string literal to
+// every function, the way generated code tends to look
+static int write_function(char* out, int i, bool comments)
+{
+  int length = 0;
+  if (comments)
+  {
+    length += snprintf(out, 256,
+      "// generated from template %d, do not edit by hand\n"
+      "var message_%d = \"function_%d takes alpha and beta and counts local_%d down\";\n",
+      i, i, i, i);
+  }
+  length += snprintf(out + length, 256,
+    "fun function_%d(alpha, beta) {\n"
+    "  var local_%d = alpha * %d.5 + beta / 3;\n"
+    "  if (local_%d >= 100 and !(beta == nil)) print \"value %d\";\n"
+    "  while (local_%d > 0) local_%d = local_%d - 1;\n"
+    "  return local_%d;\n"
+    "}\n",
+    i, i, i, i, i, i, i, i, i);
+  return length;
+}
+
+static char* make_source(size_t bytes, bool comments)
+{
+  char* source = malloc(bytes + 512);
+  size_t length = 0;
+  for (int i = 0; length < bytes; i++) length += write_function(source + length, i, comments);
+  return source;
+}
+
+static void bench_scanner(const char* name, int kilobytes, bool comments, const char* separator)
+{
+  char* source = make_source((size_t)kilobytes * 1024, comments);
+  size_t bytes = strlen(source);
+  double best = 0;
+  long tokens = 0;
+  for (int round = 0; round < 5; round++)
+  {
+    tokens = 0;
+    double start = now();
+    init_scanner(source);
+    for (;;)
+    {
+      token t = scan_token();
+      tokens++;
+      if (t.type == TOKEN_EOF || t.type == TOKEN_ERROR) break;
+    }
+    double ns = now() - start;
+    if (round == 0 || ns < best) best = ns;
+  }
+  printf("  \"%s\": {\"bytes\": %zu, \"tokens\": %ld, \"ns_per_token\": %.2f, \"mb_per_s\": %.1f}%s\n",
+         name, bytes, tokens, best / tokens, bytes / (best / 1e9) / (1024 * 1024), separator);
+  free(source);
+}
+
+// the whole front end, nothing is run. a script holds at most 256
+// constants, so the functions are compiled a few hundred at a time like
+// separate files. they stay around since major collections are off
+#define FUNCTIONS_PER_SCRIPT 200
+
+static void bench_compile(int kilobytes)
+{
+  int count = 0;
+  int capacity = 64;
+  char** scripts = malloc(sizeof(char*) * capacity);
+  size_t bytes = 0;
+  for (int i = 0; bytes < (size_t)kilobytes * 1024; count++)
+  {
+    if (count == capacity) scripts = realloc(scripts, sizeof(char*) * (capacity *= 2));
+    char* script = malloc(FUNCTIONS_PER_SCRIPT * 512);
+    size_t length = 0;
+    for (int end = i + FUNCTIONS_PER_SCRIPT; i < end; i++) length += write_function(script + length, i, false);
+    scripts[count] = script;
+    bytes += length;
+  }
+
+  double best = 0;
+  for (int round = 0; round < 5; round++)
+  {
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+      if (compile(scripts[i]) == NULL) fprintf(stderr, "the generated source doesn't compile\n");
+    }
+    double ns = now() - start;
+    if (round == 0 || ns < best) best = ns;
+  }
+  printf("  \"compile\": {\"bytes\": %zu, \"ms\": %.2f, \"mb_per_s\": %.1f}\n",
+         bytes, best / 1e6, bytes / (best / 1e9) / (1024 * 1024));
+  for (int i = 0; i < count; i++) free(scripts[i]);
+  free(scripts);
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: clox_micro [--keys n,n,...] [--delete-ratio r] [--churn n] [--strings n] "
+                  "[--source-kb n]\n");
+  exit(64);
+}
+
+int main(int argc, const char* argv[])
+{
+  const char* keys = "1024,4096,16384,65536,262144,1048576";
+  double delete_ratio = 0.5;
+  int strings = 2000000;
+  int source_kb = 4096;
+  int churn = 65536;
+  for (int i = 1; i < argc; i++)
+  {
+    if (i + 1 >= argc) usage();
+    if (strcmp(argv[i], "--keys") == 0) keys = argv[++i];
+    else if (strcmp(argv[i], "--delete-ratio") == 0) delete_ratio = atof(argv[++i]);
+    else if (strcmp(argv[i], "--strings") == 0) strings = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--source-kb") == 0) source_kb = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--churn") == 0) churn = atoi(argv[++i]);
+    else usage();
+  }
+
+  init_vm();
+  g_vm.next_gc = SIZE_MAX;
+  printf("{\n  \"delete_ratio\": %.2f,\n  \"table\": [", delete_ratio);
+  const char* separator = "";
+  for (const char* k = keys; *k != '\0';)
+  {
+    int count = atoi(k);
+    if (count > 0) bench_table(count, delete_ratio, separator);
+    separator = ",";
+    k = strchr(k, ',');
+    if (k == NULL) break;
+    k++;
+  }
+  printf("\n  ],\n");
+  bench_churn(churn);
+  bench_hashing();
+  bench_interning(strings);
+  bench_scanner("scanner", source_kb, false, ",");
+  bench_scanner("scanner_comments", source_kb, true, ",");
+  bench_compile(source_kb);
+  printf("}\n");
+  free_vm();
+  return 0;
+}
@@ -0,0 +1,203 @@
+// runs every benchmark script a number of times against one interpreter
+// and reports wall time, peak rss and executed instructions as json.
+//
+//   clox_bench [--runs N] [--output file.json] interpreter script...
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+typedef struct {
+  double seconds;
+  long max_rss_kb;
+  long long instructions; // -1 when hardware counters are not available
+  int exit_code;
+} run_result;
+
+// counts user space instructions of `pid` from its exec on, the child
+// waits for us before it execs
+static int open_instruction_counter(pid_t pid)
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+static run_result run_once(const char* interpreter, const char* script)
+{
+  run_result result = {0, 0, -1, -1};
+  int gate[2];
+  if (pipe(gate) != 0) return result;
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    char go;
+    close(gate[1]);
+    if (read(gate[0], &go, 1) != 1) _exit(127);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) dup2(null, STDOUT_FILENO);
+    execl(interpreter, interpreter, script, (char*)NULL);
+    _exit(127);
+  }
+  close(gate[0]);
+  if (pid < 0)
+  {
+    close(gate[1]);
+    return result;
+  }
+
+  int counter = open_instruction_counter(pid);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (write(gate[1], "x", 1) != 1) kill(pid, SIGKILL);
+  close(gate[1]);
+
+  int status = 0;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  result.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+#ifdef __APPLE__
+  result.max_rss_kb = usage.ru_maxrss / 1024;
+#else
+  result.max_rss_kb = usage.ru_maxrss;
+#endif
+  result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  if (counter >= 0)
+  {
+    long long count;
+    if (read(counter, &count, sizeof(count)) == sizeof(count)) result.instructions = count;
+    close(counter);
+  }
+  return result;
+}
+
+// results always go to stdout and to the --output file if there is one
+static FILE* g_output = NULL;
+
+static void report(const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  if (g_output == NULL) return;
+  va_start(args, format);
+  vfprintf(g_output, format, args);
+  va_end(args);
+}
+
+static int compare_runs(const void* a, const void* b)
+{
+  double x = ((const run_result*)a)->seconds;
+  double y = ((const run_result*)b)->seconds;
+  return (x > y) - (x < y);
+}
+
+// the file name without directory and extension
+static void benchmark_name(const char* script, char* name, size_t size)
+{
+  const char* start = strrchr(script, '/');
+  start = start == NULL ? script : start + 1;
+  snprintf(name, size, "%s", start);
+  char* dot = strrchr(name, '.');
+  if (dot != NULL) *dot = '\0';
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: clox_bench [--runs N] [--output file.json] interpreter script...\n");
+  exit(64);
+}
+
+int main(int argc, const char* argv[])
+{
+  int runs = 5;
+  const char* output = NULL;
+  int i = 1;
+  for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++)
+  {
+    if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) runs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) output = argv[++i];
+    else usage();
+  }
+  if (runs < 1 || argc - i < 2) usage();
+
+  const char* interpreter = argv[i++];
+  if (output != NULL && (g_output = fopen(output, "w")) == NULL)
+  {
+    fprintf(stderr, "Could not open \"%s\".\n", output);
+    return 74;
+  }
+
+  run_result* results = calloc(runs, sizeof(run_result));
+  bool failed = false;
+  report("{\n  \"interpreter\": \"%s\",\n  \"runs\": %d,\n  \"benchmarks\": [", interpreter, runs);
+  for (int script = i; script < argc; script++)
+  {
+    long max_rss_kb = 0;
+    long long instructions = 0;
+    int exit_code = 0;
+    for (int run = 0; run < runs; run++)
+    {
+      results[run] = run_once(interpreter, argv[script]);
+      if (results[run].max_rss_kb > max_rss_kb) max_rss_kb = results[run].max_rss_kb;
+      if (results[run].exit_code != 0) exit_code = results[run].exit_code;
+      instructions = results[run].instructions; // deterministic enough, keep the last
+    }
+    qsort(results, runs, sizeof(run_result), compare_runs);
+    double median = runs % 2 == 1 ? results[runs / 2].seconds
+                  : (results[runs / 2 - 1].seconds + results[runs / 2].seconds) / 2;
+
+    char name[256];
+    benchmark_name(argv[script], name, sizeof(name));
+    report("%s\n    {\"name\": \"%s\", \"median_s\": %.6f, \"min_s\": %.6f, "
+           "\"max_rss_kb\": %ld, \"instructions\": ",
+           script == i ? "" : ",", name, median, results[0].seconds, max_rss_kb);
+    if (instructions >= 0) report("%lld", instructions);
+    else report("null");
+    report(", \"exit_code\": %d}", exit_code);
+    fflush(stdout);
+
+    if (exit_code != 0)
+    {
+      fprintf(stderr, "%s exited with %d\n", argv[script], exit_code);
+      failed = true;
+    }
+  }
+  report("\n  ]\n}\n");
+
+  free(results);
+  if (g_output != NULL) fclose(g_output);
+  return failed ? 1 : 0;
+}
@@ -1,5 +1,6 @@
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void init_chunk(chunk* c)
 {
@@ -35,6 +36,38 @@ void write_chunk(chunk* c, uint8_t byte, int line)
 
 int add_constant(chunk* c, value v)
 {
+  push(v);
   write_value_array(&c->constants, v);
+  pop();
   return c->constants.count - 1;
+}
+
+int instruction_size(uint8_t instruction)
+{
+  switch (instruction)
+  {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUMBER:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_GET_LOCALS:
+    case OP_SET_GLOBAL_POP:
+    case OP_POP_JUMP_IF_FALSE:
+      return 3;
+    default: 
+      return 1;
+  }
 }
\ No newline at end of file
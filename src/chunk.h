@@ -29,9 +29,26 @@ typedef enum {
   OP_DIVIDE,
   OP_NOT,
   OP_CALL,
-  OP_RETURN
+  OP_TAIL_CALL,
+  OP_RETURN,
+  // superinstructions, only emitted by the peephole optimizer
+  OP_ADD_CONSTANT,
+  OP_SUBTRACT_CONSTANT,
+  OP_LESS_CONSTANT,
+  OP_GET_LOCALS,
+  OP_SET_LOCAL_POP,
+  OP_SET_GLOBAL_POP,
+  OP_POP_JUMP_IF_FALSE,
+  // quickened forms, run() rewrites the generic opcode in place once it
+  // has seen the operand types and rewrites it back on a type miss
+  OP_ADD_NUMBER,
+  OP_ADD_STRING,
+  OP_ADD_CONSTANT_NUMBER,
+  OP_EQUAL_NUMBER
 } op_code;
 
+#define OPCODE_COUNT (OP_EQUAL_NUMBER + 1) // keep in sync with the last opcode
+
 typedef struct
 {
   int count;
@@ -45,5 +62,6 @@ void init_chunk(chunk* c);
 void free_chunk(chunk* c);
 void write_chunk(chunk* c, uint8_t byte, int line);
 int add_constant(chunk* c, value v);
+int instruction_size(uint8_t instruction);
 
 #endif
\ No newline at end of file
@@ -5,9 +5,53 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXTENSION
+#endif
+
+// labels-as-values are a GCC/Clang extension, everything else uses the switch
+#if defined(CLOX_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define COMPUTED_GOTO
+#endif
+
+#ifdef CLOX_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+#ifndef CLOX_NO_CONSTANT_FOLDING
+#define CONSTANT_FOLDING
+#endif
+
+#ifndef CLOX_NO_PEEPHOLE
+#define PEEPHOLE_OPTIMIZER
+#endif
+
+// counters for --stats, they cost time on every instruction
+#ifdef CLOX_STATS
+#define VM_STATS
+#endif
+
+// the sampling profiler needs SIGPROF and setitimer
+#if defined(CLOX_PROFILER) && (defined(__unix__) || defined(__APPLE__))
+#define PROFILER
+#endif
+
+// the jit emits x86-64 and needs mmap for executable memory
+#if defined(CLOX_JIT) && defined(__x86_64__) && defined(__unix__)
+#define JIT
+#endif
+
+// new strings go to a bump allocated nursery with its own minor collection
+#ifndef CLOX_NO_GENERATIONAL_GC
+#define GENERATIONAL_GC
+#endif
+
+// collect on every allocation to shake out objects that aren't rooted
+#ifdef CLOX_STRESS_GC
+#define DEBUG_STRESS_GC
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
-#endif
\ No newline at end of file
+#endif
@@ -4,6 +4,8 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -15,6 +17,7 @@ typedef struct {
   token previous; 
   bool had_error;
   bool panic_mode;
+  int operand_start; // chunk offset where the left operand of an infix rule begins
 } parser_t;
 
 
@@ -58,6 +61,7 @@ typedef struct compiler {
   local locals[UINT8_COUNT];
   int local_count;
   int scope_depth;
+  int last_call; // offset of the latest OP_CALL, used to spot calls in tail position
 } compiler;
 
 
@@ -154,7 +158,7 @@ static void emit_byte(uint8_t byte)
   write_chunk(current_chunk(), byte, parser.previous.line);
 }
 
-static void emit_loop(uint8_t loop_start)
+static void emit_loop(int loop_start)
 {
   emit_byte(OP_LOOP);
 
@@ -173,6 +177,12 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2)
   emit_byte(byte2);
 }
 
+static void emit_short(uint16_t operand)
+{
+  emit_byte((operand >> 8) & 0xff);
+  emit_byte(operand & 0xff);
+}
+
 static int emit_jump(uint8_t instruction)
 {
   emit_byte(instruction);
@@ -190,6 +200,7 @@ static void emit_return()
 static uint8_t make_constant(value v)
 {
   int constant = add_constant(current_chunk(), v);
+  write_barrier((obj*)current->function, v);
   if (constant > UINT8_MAX)
   {
     error("Too many constants in one chunk");
@@ -221,12 +232,15 @@ static void init_compiler(compiler* c, function_type type)
   c->type = type;
   c->local_count = 0;
   c->scope_depth = 0; 
+  c->last_call = -1;
   c->function = new_function();
   current = c;
 
   if (type != TYPE_SCRIPT)
   {
-    current->function->name = copy_string(parser.previous.start, parser.previous.length);
+    obj_string* name = copy_string(parser.previous.start, parser.previous.length);
+    current->function->name = name;
+    write_barrier((obj*)current->function, OBJ_VAL(name));
   }
 
   local* l = &current->locals[current->local_count++];
@@ -240,11 +254,20 @@ static obj_function* end_compiler()
   emit_return();
   obj_function* func = current->function;
 
+#ifdef PEEPHOLE_OPTIMIZER
+  peephole_stats stats = optimize_chunk(current_chunk());
+  (void)stats; // only printed with DEBUG_PRINT_CODE
+#endif
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.had_error)
   {
     disassemble_chunk(current_chunk(), 
       func->name != NULL ? func->name->chars : "<script>");
+#ifdef PEEPHOLE_OPTIMIZER
+    printf("peephole: %d -> %d instructions\n", 
+      stats.instructions_before, stats.instructions_after);
+#endif
   }
 #endif
   
@@ -267,6 +290,131 @@ static void end_scope()
   }
 }
 
+#ifdef CONSTANT_FOLDING
+// true if the code in [start, end) is exactly one instruction pushing a
+// constant, which makes it safe to fold: nothing can jump into the middle
+static bool constant_operand(int start, int end, value* v)
+{
+  chunk* c = current_chunk();
+  if (end - start == 2 && c->code[start] == OP_CONSTANT)
+  {
+    *v = c->constants.values[c->code[start+1]];
+    return true;
+  }
+  if (end - start != 1) { return false; }
+  switch (c->code[start])
+  {
+    case OP_NIL:    *v = NIL_VAL; return true;
+    case OP_TRUE:   *v = BOOL_VAL(true); return true;
+    case OP_FALSE:  *v = BOOL_VAL(false); return true;
+    default: return false;
+  }
+}
+
+static void drop_constant(int offset)
+{
+  chunk* c = current_chunk();
+  if (c->code[offset] == OP_CONSTANT && c->code[offset+1] == c->constants.count-1)
+  {
+    c->constants.count--;
+  }
+}
+
+// rewrites the operand instructions starting at `start` into a single
+// instruction pushing v. operands are dropped right to left so their
+// slots in the constant pool can be reused
+static void fold_constant(int start, int right_start, value v)
+{
+  chunk* c = current_chunk();
+  drop_constant(right_start);
+  if (right_start != start) 
+  {
+    drop_constant(start);
+  }
+  c->count = start;
+
+  if (IS_NIL(v))        { emit_byte(OP_NIL); }
+  else if (IS_BOOL(v))  { emit_byte(AS_BOOL(v) ? OP_TRUE : OP_FALSE); }
+  else                  { emit_constant(v); }
+}
+
+static bool is_falsey_constant(value v)
+{
+  return IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v)); 
+}
+
+static bool fold_binary(token_type operator_type, int start, int right_start)
+{
+  value a, b;
+  if (!constant_operand(start, right_start, &a) 
+    || !constant_operand(right_start, current_chunk()->count, &b))
+  {
+    return false;
+  }
+
+  value result;
+  switch (operator_type)
+  {
+    case TOKEN_BANG_EQUAL:            result = BOOL_VAL(!values_equal(a, b));
+    break; case TOKEN_EQUAL_EQUAL:    result = BOOL_VAL(values_equal(a, b));
+    break; case TOKEN_PLUS:
+      if (IS_STRING(a) && IS_STRING(b))
+      {
+        // the operands can move while the result is allocated
+        push(a);
+        push(b);
+        obj_string* str = new_string(AS_STRING(a)->length + AS_STRING(b)->length);
+        obj_string* sb = AS_STRING(pop());
+        obj_string* sa = AS_STRING(pop());
+        memcpy(str->chars, sa->chars, sa->length);
+        memcpy(str->chars + sa->length, sb->chars, sb->length);
+        result = OBJ_VAL(intern_string(str));
+        break;
+      }
+      // numbers are folded below
+      /* fall through */
+    default:
+      // everything else only folds numbers, mixed types stay a runtime error
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) { return false; }
+      double x = AS_NUMBER(a);
+      double y = AS_NUMBER(b);
+      switch (operator_type)
+      {
+        case TOKEN_GREATER:               result = BOOL_VAL(x > y);
+        break; case TOKEN_GREATER_EQUAL:  result = BOOL_VAL(!(x < y));
+        break; case TOKEN_LESS:           result = BOOL_VAL(x < y);
+        break; case TOKEN_LESS_EQUAL:     result = BOOL_VAL(!(x > y));
+        break; case TOKEN_PLUS:           result = NUMBER_VAL(x + y);
+        break; case TOKEN_MINUS:          result = NUMBER_VAL(x - y);
+        break; case TOKEN_STAR:           result = NUMBER_VAL(x * y);
+        break; case TOKEN_SLASH:          result = NUMBER_VAL(x / y);
+        break; default: return false;
+      }
+  }
+  fold_constant(start, right_start, result);
+  return true;
+}
+
+static bool fold_unary(token_type operator_type, int start)
+{
+  value v;
+  if (!constant_operand(start, current_chunk()->count, &v))
+  {
+    return false;
+  }
+  switch (operator_type)
+  {
+    case TOKEN_BANG: v = BOOL_VAL(is_falsey_constant(v));
+    break; case TOKEN_MINUS: 
+      if (!IS_NUMBER(v)) { return false; }
+      v = NUMBER_VAL(-AS_NUMBER(v));
+    break; default: return false;
+  }
+  fold_constant(start, start, v);
+  return true;
+}
+#endif
+
 static void expression();
 static void statement();
 static void declaration();
@@ -283,8 +431,16 @@ static void grouping(bool can_assign)
 static void binary(bool can_assign)
 {
   token_type operator_type = parser.previous.type;
+  int start = parser.operand_start;
+  int right_start = current_chunk()->count;
   parse_rule* rule = get_rule(operator_type);
   parse_precedence((precedence_type)(rule->precedence + 1));
+#ifdef CONSTANT_FOLDING
+  if (fold_binary(operator_type, start, right_start)) 
+  {
+    return;
+  }
+#endif
   switch (operator_type)
   {
     case TOKEN_BANG_EQUAL:            emit_bytes(OP_EQUAL, OP_NOT);
@@ -323,9 +479,15 @@ static void string(bool can_assign)
   emit_constant(OBJ_VAL(copy_string(parser.previous.start+1 , parser.previous.length-2)));
 }
 
-static uint8_t identifier_constant(token* name)
+static uint16_t identifier_slot(token* name)
 {
-  return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+  int slot = global_slot(copy_string(name->start, name->length));
+  if (slot > UINT16_MAX)
+  {
+    error("Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
 }
 
 static bool identifiers_equal(token* a, token* b)
@@ -400,26 +562,34 @@ static void named_variable(token name, bool can_assign)
 {
   uint8_t get_op, set_op;
   int arg = resolve_local(current, &name);
-  if (arg != -1) 
+  bool is_global = arg == -1;
+  if (!is_global) 
   {
     get_op = OP_GET_LOCAL;
     set_op = OP_SET_LOCAL;
   }
   else 
   {
-    arg = identifier_constant(&name);
+    arg = identifier_slot(&name);
     get_op = OP_GET_GLOBAL;
     set_op = OP_SET_GLOBAL;
   }
   
+  uint8_t op = get_op;
   if (can_assign && match(TOKEN_EQUAL))
   {
     expression();
-    emit_bytes(set_op, (uint8_t)arg);
+    op = set_op;
+  }
+
+  if (is_global)
+  {
+    emit_byte(op);
+    emit_short((uint16_t)arg);
   }
   else 
   {
-    emit_bytes(get_op, (uint8_t)arg);
+    emit_bytes(op, (uint8_t)arg);
   }
 }
 
@@ -431,8 +601,15 @@ static void variable(bool can_assign)
 static void unary(bool can_assign) 
 {
   token_type operator_type = parser.previous.type;
+  int start = current_chunk()->count;
 
   parse_precedence(PREC_UNARY);
+#ifdef CONSTANT_FOLDING
+  if (fold_unary(operator_type, start)) 
+  {
+    return;
+  }
+#endif
 
   switch (operator_type)
   {
@@ -484,6 +661,7 @@ static uint8_t argument_list()
 static void call(bool can_assign)
 {
   uint8_t arg_count = argument_list();
+  current->last_call = current_chunk()->count;
   emit_bytes(OP_CALL, arg_count);
 }
 
@@ -544,12 +722,14 @@ static void parse_precedence(precedence_type precedence)
   }
   
   bool can_assign = precedence <= PREC_ASSIGNMENT;
+  int start = current_chunk()->count;
   prefix_rule(can_assign);
 
   while(precedence <= get_rule(parser.current.type)->precedence) 
   {
     advance();
     parse_fn infix_rule = get_rule(parser.previous.type)->infix;
+    parser.operand_start = start;
     infix_rule(can_assign);
   }
   if (can_assign && match(TOKEN_EQUAL))
@@ -559,12 +739,12 @@ static void parse_precedence(precedence_type precedence)
 }
 
 
-static uint8_t parse_variable(const char* errormsg)
+static uint16_t parse_variable(const char* errormsg)
 {
   consume(TOKEN_IDENTIFIER, errormsg);
   declare_variable();
   if (current->scope_depth > 0) { return 0; }
-  return identifier_constant(&parser.previous);
+  return identifier_slot(&parser.previous);
 }
 
 static void mark_initialized()
@@ -579,14 +759,15 @@ static void mark_initialized()
   }
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(uint16_t global)
 {
   if (current->scope_depth > 0) 
   {
     mark_initialized();
     return ;
   }
-  emit_bytes(OP_DEFINE_GLOBAL, global);
+  emit_byte(OP_DEFINE_GLOBAL);
+  emit_short(global);
 }
 
 
@@ -625,7 +806,7 @@ static void function(function_type type)
       {
         error_at_current("Can't have more than 255 parameters");
       }
-      uint8_t constant = parse_variable("Expect parameter name");
+      uint16_t constant = parse_variable("Expect parameter name");
       define_variable(constant);
     }
     while (match(TOKEN_COMMA));
@@ -641,7 +822,7 @@ static void function(function_type type)
 
 static void fun_declaration()
 {
-  uint8_t global = parse_variable("Expect function name");
+  uint16_t global = parse_variable("Expect function name");
   mark_initialized();
   function(TYPE_FUNCTION);
   define_variable(global);
@@ -649,7 +830,7 @@ static void fun_declaration()
 
 static void var_declaration()
 {
-  uint8_t global = parse_variable("Expect variable name.");
+  uint16_t global = parse_variable("Expect variable name.");
   if (match(TOKEN_EQUAL))
   {
     expression();
@@ -769,6 +950,11 @@ static void return_statement()
   {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // the OP_RETURN stays behind the tail call, natives fall through to it
+    if (current->last_call >= 0 && current->last_call == current_chunk()->count - 2)
+    {
+      current_chunk()->code[current->last_call] = OP_TAIL_CALL;
+    }
     emit_byte(OP_RETURN);
   }
 }
@@ -887,3 +1073,12 @@ obj_function* compile(const char* source)
 
   return parser.had_error ? NULL : func;
 }
+
+// functions still being compiled are only reachable from here
+void mark_compiler_roots()
+{
+  for (compiler* c = current; c != NULL; c = c->enclosing)
+  {
+    mark_object((obj*)c->function);
+  }
+}
@@ -5,5 +5,6 @@
 #include "vm.h"
 
 obj_function* compile(const char* source);
+void mark_compiler_roots();
 
 #endif 
\ No newline at end of file
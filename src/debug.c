@@ -1,7 +1,54 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
+
+static const char* opcode_names[] = {
+  [OP_CONSTANT]            = "OP_CONSTANT",
+  [OP_NIL]                 = "OP_NIL",
+  [OP_TRUE]                = "OP_TRUE",
+  [OP_FALSE]               = "OP_FALSE",
+  [OP_POP]                 = "OP_POP",
+  [OP_GET_LOCAL]           = "OP_GET_LOCAL",
+  [OP_SET_LOCAL]           = "OP_SET_LOCAL",
+  [OP_GET_GLOBAL]          = "OP_GET_GLOBAL",
+  [OP_DEFINE_GLOBAL]       = "OP_DEFINE_GLOBAL",
+  [OP_SET_GLOBAL]          = "OP_SET_GLOBAL",
+  [OP_EQUAL]               = "OP_EQUAL",
+  [OP_GREATER]             = "OP_GREATER",
+  [OP_LESS]                = "OP_LESS",
+  [OP_NEGATE]              = "OP_NEGATE",
+  [OP_PRINT]               = "OP_PRINT",
+  [OP_JUMP]                = "OP_JUMP",
+  [OP_JUMP_IF_FALSE]       = "OP_JUMP_IF_FALSE",
+  [OP_LOOP]                = "OP_LOOP",
+  [OP_ADD]                 = "OP_ADD",
+  [OP_SUBTRACT]            = "OP_SUBTRACT",
+  [OP_MULTIPLY]            = "OP_MULTIPLY",
+  [OP_DIVIDE]              = "OP_DIVIDE",
+  [OP_NOT]                 = "OP_NOT",
+  [OP_CALL]                = "OP_CALL",
+  [OP_TAIL_CALL]           = "OP_TAIL_CALL",
+  [OP_RETURN]              = "OP_RETURN",
+  [OP_ADD_CONSTANT]        = "OP_ADD_CONSTANT",
+  [OP_SUBTRACT_CONSTANT]   = "OP_SUBTRACT_CONSTANT",
+  [OP_LESS_CONSTANT]       = "OP_LESS_CONSTANT",
+  [OP_GET_LOCALS]          = "OP_GET_LOCALS",
+  [OP_SET_LOCAL_POP]       = "OP_SET_LOCAL_POP",
+  [OP_SET_GLOBAL_POP]      = "OP_SET_GLOBAL_POP",
+  [OP_POP_JUMP_IF_FALSE]   = "OP_POP_JUMP_IF_FALSE",
+  [OP_ADD_NUMBER]          = "OP_ADD_NUMBER",
+  [OP_ADD_STRING]          = "OP_ADD_STRING",
+  [OP_ADD_CONSTANT_NUMBER] = "OP_ADD_CONSTANT_NUMBER",
+  [OP_EQUAL_NUMBER]        = "OP_EQUAL_NUMBER",
+};
+
+const char* opcode_name(uint8_t instruction)
+{
+  return instruction < OPCODE_COUNT ? opcode_names[instruction] : "OP_UNKNOWN";
+}
 
 static int constant_instruction(const char* name, chunk* c, int offset)
 {
@@ -12,6 +59,16 @@ static int constant_instruction(const char* name, chunk* c, int offset)
   return offset+2;
 }
 
+static int global_instruction(const char* name, chunk* c, int offset)
+{
+  uint16_t slot = (uint16_t)(c->code[offset+1] << 8);
+  slot |= c->code[offset+2];
+  printf("%-16s %4d '", name, slot);
+  print_value(g_vm.global_names.values[slot]);
+  printf("'\n");
+  return offset+3;
+}
+
 static int simple_instruction(const char* name, int offset)
 {
   printf("%s\n", name);
@@ -25,6 +82,12 @@ static int byte_instruction(const char* name, chunk* c, int offset)
   return offset + 2;
 }
 
+static int two_byte_instruction(const char* name, chunk* c, int offset)
+{
+  printf("%-16s %4d %4d\n", name, c->code[offset+1], c->code[offset+2]);
+  return offset + 3;
+}
+
 static int jump_instruction(const char* name, int sign, chunk* c, int offset)
 {
   uint16_t jump = (uint16_t)(c->code[offset+1] << 8);
@@ -68,11 +131,11 @@ int disassemble_instruction(chunk* c, int offset)
   case OP_FALSE:
     return simple_instruction("OP_FALSE", offset);
   case OP_GET_GLOBAL:
-    return constant_instruction("OP_GET_GLOBAL", c, offset);
+    return global_instruction("OP_GET_GLOBAL", c, offset);
   case OP_DEFINE_GLOBAL:
-    return constant_instruction("OP_DEFINE_GLOBAL", c, offset);
+    return global_instruction("OP_DEFINE_GLOBAL", c, offset);
   case OP_SET_GLOBAL:
-    return constant_instruction("OP_SET_GLOBAL", c, offset);
+    return global_instruction("OP_SET_GLOBAL", c, offset);
   case OP_EQUAL:
     return simple_instruction("OP_EQUAL", offset);
   case OP_POP:
@@ -105,8 +168,32 @@ int disassemble_instruction(chunk* c, int offset)
     return jump_instruction("OP_LOOP", -1, c, offset);
   case OP_CALL:
     return byte_instruction("OP_CALL", c, offset);
+  case OP_TAIL_CALL:
+    return byte_instruction("OP_TAIL_CALL", c, offset);
   case OP_RETURN:
     return simple_instruction("OP_RETURN", offset);
+  case OP_ADD_CONSTANT:
+    return constant_instruction("OP_ADD_CONSTANT", c, offset);
+  case OP_SUBTRACT_CONSTANT:
+    return constant_instruction("OP_SUBTRACT_CONSTANT", c, offset);
+  case OP_LESS_CONSTANT:
+    return constant_instruction("OP_LESS_CONSTANT", c, offset);
+  case OP_GET_LOCALS:
+    return two_byte_instruction("OP_GET_LOCALS", c, offset);
+  case OP_SET_LOCAL_POP:
+    return byte_instruction("OP_SET_LOCAL_POP", c, offset);
+  case OP_SET_GLOBAL_POP:
+    return global_instruction("OP_SET_GLOBAL_POP", c, offset);
+  case OP_POP_JUMP_IF_FALSE:
+    return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, c, offset);
+  case OP_ADD_NUMBER:
+    return simple_instruction("OP_ADD_NUMBER", offset);
+  case OP_ADD_STRING:
+    return simple_instruction("OP_ADD_STRING", offset);
+  case OP_ADD_CONSTANT_NUMBER:
+    return constant_instruction("OP_ADD_CONSTANT_NUMBER", c, offset);
+  case OP_EQUAL_NUMBER:
+    return simple_instruction("OP_EQUAL_NUMBER", offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset+1;
@@ -5,5 +5,6 @@
 
 void disassemble_chunk(chunk* c, const char* name);
 int disassemble_instruction(chunk* c, int offset);
+const char* opcode_name(uint8_t instruction);
 
 #endif 
\ No newline at end of file
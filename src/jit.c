@@ -0,0 +1,640 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "profiler.h"
+
+// a baseline template compiler: every bytecode instruction becomes a fixed
+// snippet of x86-64 that works on the vm stack in memory exactly like the
+// interpreter does. nothing stays in a register from one instruction to
+// the next, so native code can be entered at any instruction (that is how
+// a hot loop moves over in the middle of a function) and slow paths just
+// call back into the vm.
+//
+// registers inside generated code:
+//   rbx  the call_frame being run
+//   r12  frame->slots
+//   r13  &g_vm.stack_top
+//   rax, rcx, rdx, rdi, rsi, xmm0 and xmm1 are scratch, rcx mostly holds
+//   the stack top
+
+struct jit_code {
+  uint8_t* memory;
+  size_t size;
+  int* entries; // machine code offset per bytecode offset, -1 inside an instruction
+  int entry_count;
+};
+
+typedef jit_status (*native_entry)(call_frame* frame, uint8_t* entry);
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13 };
+enum { XMM0, XMM1 };
+
+#define JMP     0x00
+#define CC_E    0x04
+#define CC_NE   0x05
+#define CC_A    0x07
+
+// jumps either go to a bytecode offset or to one of the exits, which are
+// numbered after the jit_status they return
+#define EXIT(status) (-1 - (status))
+#define EXIT_COUNT 3
+
+#define VALUE_SIZE ((int)sizeof(value))
+#ifdef NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int)offsetof(value, as))
+#endif
+
+typedef struct {
+  int at;     // where the rel32 sits
+  int target; // bytecode offset or EXIT(status)
+} fixup;
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+  fixup* fixups;
+  int fixup_count;
+  int fixup_capacity;
+  int* entries;
+} assembler;
+
+static void emit(assembler* a, uint8_t byte)
+{
+  if (a->capacity < a->count + 1)
+  {
+    int old_capacity = a->capacity;
+    a->capacity = GROW_CAPACITY(old_capacity);
+    a->code = GROW_ARRAY(uint8_t, a->code, old_capacity, a->capacity);
+  }
+  a->code[a->count++] = byte;
+}
+
+static void emit32(assembler* a, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) emit(a, (uint8_t)(v >> (8 * i)));
+}
+
+static void emit64(assembler* a, uint64_t v)
+{
+  for (int i = 0; i < 8; i++) emit(a, (uint8_t)(v >> (8 * i)));
+}
+
+static void patch32(assembler* a, int at, int32_t v)
+{
+  memcpy(&a->code[at], &v, sizeof(v));
+}
+
+static void rex(assembler* a, bool wide, int reg, int base)
+{
+  uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3);
+  if (prefix != 0x40) emit(a, prefix);
+}
+
+// modrm for [base + disp32], rsp and r12 need a sib byte as base
+static void mem(assembler* a, int reg, int base, int32_t disp)
+{
+  emit(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emit(a, 0x24);
+  emit32(a, (uint32_t)disp);
+}
+
+static void load(assembler* a, int reg, int base, int32_t disp)
+{
+  rex(a, true, reg, base);
+  emit(a, 0x8b);
+  mem(a, reg, base, disp);
+}
+
+static void store(assembler* a, int base, int32_t disp, int reg)
+{
+  rex(a, true, reg, base);
+  emit(a, 0x89);
+  mem(a, reg, base, disp);
+}
+
+static void load_imm(assembler* a, int reg, uint64_t imm)
+{
+  rex(a, true, 0, reg);
+  emit(a, 0xb8 + (reg & 7));
+  emit64(a, imm);
+}
+
+// movsd/addsd/... with `prefix` 0xf2 and ucomisd with 0x66
+static void sse(assembler* a, uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp)
+{
+  emit(a, prefix);
+  rex(a, false, xmm, base);
+  emit(a, 0x0f);
+  emit(a, op);
+  mem(a, xmm, base, disp);
+}
+
+#ifdef NAN_BOXING
+// only the nan boxed templates compare whole values in registers
+static void cmp_reg(assembler* a, int left, int right)
+{
+  rex(a, true, right, left);
+  emit(a, 0x39);
+  emit(a, 0xc0 | ((right & 7) << 3) | (left & 7));
+}
+#endif
+
+static void cmp_dword(assembler* a, int base, int32_t disp, uint32_t imm)
+{
+  rex(a, false, 0, base);
+  emit(a, 0x81);
+  mem(a, 7, base, disp);
+  emit32(a, imm);
+}
+
+static void jump(assembler* a, uint8_t cc, int target)
+{
+  if (cc == JMP)
+  {
+    emit(a, 0xe9);
+  }
+  else
+  {
+    emit(a, 0x0f);
+    emit(a, 0x80 | cc);
+  }
+  if (a->fixup_capacity < a->fixup_count + 1)
+  {
+    int old_capacity = a->fixup_capacity;
+    a->fixup_capacity = GROW_CAPACITY(old_capacity);
+    a->fixups = GROW_ARRAY(fixup, a->fixups, old_capacity, a->fixup_capacity);
+  }
+  a->fixups[a->fixup_count++] = (fixup){a->count, target};
+  emit32(a, 0);
+}
+
+// a jump inside one template, land() points it at the current position
+static int jump_forward(assembler* a, uint8_t cc)
+{
+  if (cc == JMP)
+  {
+    emit(a, 0xe9);
+  }
+  else
+  {
+    emit(a, 0x0f);
+    emit(a, 0x80 | cc);
+  }
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+static void land(assembler* a, int at)
+{
+  patch32(a, at, a->count - (at + 4));
+}
+
+static void call_helper(assembler* a, void* helper)
+{
+  load_imm(a, RAX, (uint64_t)(uintptr_t)helper);
+  emit(a, 0xff); // call rax
+  emit(a, 0xd0);
+}
+
+// leaves through the error exit if the helper returned false
+static void check_helper(assembler* a)
+{
+  emit(a, 0x84); // test al, al
+  emit(a, 0xc0);
+  jump(a, CC_E, EXIT(JIT_ERROR));
+}
+
+// runtime errors and calls read the line and return address from frame->ip
+static void save_ip(assembler* a, uint8_t* ip)
+{
+  load_imm(a, RAX, (uint64_t)(uintptr_t)ip);
+  store(a, RBX, offsetof(call_frame, ip), RAX);
+}
+
+static void arg_imm(assembler* a, int reg, uint32_t imm)
+{
+  emit(a, 0xb8 + reg); // mov edi/esi, imm32
+  emit32(a, imm);
+}
+
+static void stack_top(assembler* a)
+{
+  load(a, RCX, R13, 0);
+}
+
+static void adjust_stack(assembler* a, int values)
+{
+  rex(a, true, 0, R13);
+  emit(a, 0x83); // add qword [r13], imm8
+  mem(a, 0, R13, 0);
+  emit(a, (uint8_t)(int8_t)(values * VALUE_SIZE));
+}
+
+static void copy_value(assembler* a, int dst, int32_t dst_disp, int src, int32_t src_disp)
+{
+  for (int word = 0; word < VALUE_SIZE; word += 8)
+  {
+    load(a, RAX, src, src_disp + word);
+    store(a, dst, dst_disp + word, RAX);
+  }
+}
+
+static void push_from(assembler* a, int base, int32_t disp)
+{
+  stack_top(a);
+  copy_value(a, RCX, 0, base, disp);
+  adjust_stack(a, 1);
+}
+
+static void push_value(assembler* a, value v)
+{
+  uint64_t words[sizeof(value) / 8];
+  memcpy(words, &v, sizeof(value));
+  stack_top(a);
+  for (int word = 0; word < VALUE_SIZE / 8; word++)
+  {
+    load_imm(a, RAX, words[word]);
+    store(a, RCX, word * 8, RAX);
+  }
+  adjust_stack(a, 1);
+}
+
+// returns a jump to patch that is taken unless [rcx + disp] holds a number
+static int guard_number(assembler* a, int32_t disp)
+{
+#ifdef NAN_BOXING
+  load(a, RAX, RCX, disp);
+  load_imm(a, RDX, QNAN);
+  emit(a, 0x48); emit(a, 0x21); emit(a, 0xd0); // and rax, rdx
+  cmp_reg(a, RAX, RDX);
+  return jump_forward(a, CC_E);
+#else
+  cmp_dword(a, RCX, disp + offsetof(value, type), VAL_NUMBER);
+  return jump_forward(a, CC_NE);
+#endif
+}
+
+// turns the flag in al into a bool at [rcx + disp]
+static void store_bool(assembler* a, int32_t disp)
+{
+#ifdef NAN_BOXING
+  emit(a, 0x0f); emit(a, 0xb6); emit(a, 0xc0); // movzx eax, al
+  load_imm(a, RDX, FALSE_VAL);
+  emit(a, 0x48); emit(a, 0x09); emit(a, 0xd0); // or rax, rdx
+  store(a, RCX, disp, RAX);
+#else
+  rex(a, false, 0, RCX);
+  emit(a, 0xc7); // mov dword [rcx + disp], VAL_BOOL
+  mem(a, 0, RCX, disp + offsetof(value, type));
+  emit32(a, VAL_BOOL);
+  emit(a, 0x88); // mov byte [rcx + disp + as], al
+  mem(a, 0, RCX, disp + NUMBER_OFFSET);
+#endif
+}
+
+// jumps to bytecode `target` if [rcx + disp] is falsey
+static void jump_if_falsey(assembler* a, int32_t disp, int target)
+{
+#ifdef NAN_BOXING
+  load(a, RAX, RCX, disp);
+  load_imm(a, RDX, NIL_VAL);
+  cmp_reg(a, RAX, RDX);
+  jump(a, CC_E, target);
+  load_imm(a, RDX, FALSE_VAL);
+  cmp_reg(a, RAX, RDX);
+  jump(a, CC_E, target);
+#else
+  cmp_dword(a, RCX, disp + offsetof(value, type), VAL_NIL);
+  jump(a, CC_E, target);
+  cmp_dword(a, RCX, disp + offsetof(value, type), VAL_BOOL);
+  int truthy = jump_forward(a, CC_NE);
+  emit(a, 0x80); // cmp byte [rcx + disp + as], 0
+  mem(a, 7, RCX, disp + NUMBER_OFFSET);
+  emit(a, 0);
+  jump(a, CC_E, target);
+  land(a, truthy);
+#endif
+}
+
+// numbers are handled inline, anything else goes to jit_binary() which
+// concatenates strings or reports the error
+static void binary_op(assembler* a, uint8_t op, uint8_t* next)
+{
+  int32_t left = -2 * VALUE_SIZE;
+  int32_t right = -VALUE_SIZE;
+
+  stack_top(a);
+  int slow_left = guard_number(a, left);
+  int slow_right = guard_number(a, right);
+  sse(a, 0xf2, 0x10, XMM0, RCX, left + NUMBER_OFFSET); // movsd xmm0, left
+  switch (op)
+  {
+    case OP_GREATER:
+      sse(a, 0x66, 0x2e, XMM0, RCX, right + NUMBER_OFFSET); // ucomisd xmm0, right
+      emit(a, 0x0f); emit(a, 0x97); emit(a, 0xc0);          // seta al
+      store_bool(a, left);
+      break;
+    case OP_LESS:
+      sse(a, 0xf2, 0x10, XMM1, RCX, right + NUMBER_OFFSET);
+      sse(a, 0x66, 0x2e, XMM1, RCX, left + NUMBER_OFFSET);
+      emit(a, 0x0f); emit(a, 0x97); emit(a, 0xc0);
+      store_bool(a, left);
+      break;
+    default:
+    {
+      uint8_t sse_op = op == OP_ADD ? 0x58 : op == OP_SUBTRACT ? 0x5c :
+                       op == OP_MULTIPLY ? 0x59 : 0x5e;
+      sse(a, 0xf2, sse_op, XMM0, RCX, right + NUMBER_OFFSET);
+      sse(a, 0xf2, 0x11, XMM0, RCX, left + NUMBER_OFFSET); // movsd left, xmm0
+    }
+  }
+  adjust_stack(a, -1);
+  int done = jump_forward(a, JMP);
+
+  land(a, slow_left);
+  land(a, slow_right);
+  save_ip(a, next);
+  arg_imm(a, RDI, op);
+  call_helper(a, jit_binary);
+  check_helper(a);
+  land(a, done);
+}
+
+static void helper_op(assembler* a, void* helper, uint8_t op, uint8_t* next)
+{
+  save_ip(a, next);
+  arg_imm(a, RDI, op);
+  call_helper(a, helper);
+  check_helper(a);
+}
+
+static void global_op(assembler* a, uint8_t op, uint16_t slot, uint8_t* next)
+{
+  save_ip(a, next);
+  arg_imm(a, RDI, op);
+  arg_imm(a, RSI, slot);
+  call_helper(a, jit_global);
+  check_helper(a);
+}
+
+// reads defined globals inline, the helper only reports undefined ones
+static void get_global(assembler* a, uint16_t slot, uint8_t* next)
+{
+  int32_t disp = slot * VALUE_SIZE;
+  load_imm(a, RDX, (uint64_t)(uintptr_t)&g_vm.global_values.values);
+  load(a, RDX, RDX, 0);
+#ifdef NAN_BOXING
+  load(a, RAX, RDX, disp);
+  load_imm(a, RSI, UNDEFINED_VAL);
+  cmp_reg(a, RAX, RSI);
+  int undefined = jump_forward(a, CC_E);
+#else
+  cmp_dword(a, RDX, disp + offsetof(value, type), VAL_UNDEFINED);
+  int undefined = jump_forward(a, CC_E);
+#endif
+  push_from(a, RDX, disp);
+  int done = jump_forward(a, JMP);
+  land(a, undefined);
+  global_op(a, OP_GET_GLOBAL, slot, next);
+  land(a, done);
+}
+
+// the same safe points the interpreter samples at, frame->ip has to be
+// current for the sample to see the right line
+static void sample_point(assembler* a, uint8_t* ip)
+{
+#ifdef PROFILER
+  load_imm(a, RAX, (uint64_t)(uintptr_t)&g_sample_pending);
+  cmp_dword(a, RAX, 0, 0);
+  int skip = jump_forward(a, CC_E);
+  save_ip(a, ip);
+  call_helper(a, take_sample);
+  land(a, skip);
+#else
+  (void)a;
+  (void)ip;
+#endif
+}
+
+static void exit_with(assembler* a, jit_status status)
+{
+  arg_imm(a, RAX, status);
+  emit(a, 0x41); emit(a, 0x5d); // pop r13
+  emit(a, 0x41); emit(a, 0x5c); // pop r12
+  emit(a, 0x5b);                // pop rbx
+  emit(a, 0xc3);                // ret
+}
+
+static void free_assembler(assembler* a, int chunk_count)
+{
+  FREE_ARRAY(uint8_t, a->code, a->capacity);
+  FREE_ARRAY(fixup, a->fixups, a->fixup_capacity);
+  FREE_ARRAY(int, a->entries, chunk_count);
+}
+
+// translates the whole chunk or returns NULL when it meets an instruction
+// it has no template for, the function then stays in the interpreter
+static jit_code* compile_function(obj_function* func)
+{
+  chunk* c = &func->chunk;
+  assembler a = {0};
+  a.entries = ALLOCATE(int, c->count);
+  for (int i = 0; i < c->count; i++) a.entries[i] = -1;
+
+  // entry(frame, entry point): save what we use, then jump to the
+  // instruction the frame is at
+  emit(&a, 0x53);                  // push rbx
+  emit(&a, 0x41); emit(&a, 0x54);  // push r12
+  emit(&a, 0x41); emit(&a, 0x55);  // push r13
+  emit(&a, 0x48); emit(&a, 0x89); emit(&a, 0xfb); // mov rbx, rdi
+  load(&a, R12, RDI, offsetof(call_frame, slots));
+  load_imm(&a, R13, (uint64_t)(uintptr_t)&g_vm.stack_top);
+  emit(&a, 0xff); emit(&a, 0xe6);  // jmp rsi
+
+  for (int offset = 0; offset < c->count;)
+  {
+    uint8_t* ip = &c->code[offset];
+    int size = instruction_size(*ip);
+    uint8_t* next = ip + size;
+    uint16_t operand = size == 3 ? (uint16_t)((ip[1] << 8) | ip[2]) : ip[1];
+    a.entries[offset] = a.count;
+
+    switch (*ip)
+    {
+      case OP_CONSTANT:
+        load_imm(&a, RDX, (uint64_t)(uintptr_t)&c->constants.values[ip[1]]);
+        push_from(&a, RDX, 0);
+      break; case OP_NIL: push_value(&a, NIL_VAL);
+      break; case OP_TRUE: push_value(&a, BOOL_VAL(true));
+      break; case OP_FALSE: push_value(&a, BOOL_VAL(false));
+      break; case OP_POP: adjust_stack(&a, -1);
+      break; case OP_GET_LOCAL: push_from(&a, R12, ip[1] * VALUE_SIZE);
+      break; case OP_SET_LOCAL:
+        stack_top(&a);
+        copy_value(&a, R12, ip[1] * VALUE_SIZE, RCX, -VALUE_SIZE);
+      break; case OP_GET_LOCALS:
+        push_from(&a, R12, ip[1] * VALUE_SIZE);
+        push_from(&a, R12, ip[2] * VALUE_SIZE);
+      break; case OP_SET_LOCAL_POP:
+        adjust_stack(&a, -1);
+        stack_top(&a);
+        copy_value(&a, R12, ip[1] * VALUE_SIZE, RCX, 0);
+      break; case OP_GET_GLOBAL: get_global(&a, operand, next);
+      break; case OP_DEFINE_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_POP:
+        global_op(&a, *ip, operand, next);
+      break; case OP_EQUAL:
+      case OP_EQUAL_NUMBER:
+        helper_op(&a, jit_binary, OP_EQUAL, next);
+      break; case OP_GREATER:
+      case OP_LESS:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+        binary_op(&a, *ip, next);
+      break; case OP_ADD:
+      case OP_ADD_NUMBER:
+      case OP_ADD_STRING:
+        binary_op(&a, OP_ADD, next);
+      break; case OP_ADD_CONSTANT:
+      case OP_ADD_CONSTANT_NUMBER:
+      case OP_SUBTRACT_CONSTANT:
+      case OP_LESS_CONSTANT:
+        load_imm(&a, RDX, (uint64_t)(uintptr_t)&c->constants.values[ip[1]]);
+        push_from(&a, RDX, 0);
+        binary_op(&a, *ip == OP_SUBTRACT_CONSTANT ? OP_SUBTRACT :
+                      *ip == OP_LESS_CONSTANT ? OP_LESS : OP_ADD, next);
+      break; case OP_NOT:
+      case OP_NEGATE:
+      case OP_PRINT:
+        helper_op(&a, jit_unary, *ip, next);
+      break; case OP_JUMP: jump(&a, JMP, offset + size + operand);
+      break; case OP_LOOP:
+        // like the interpreter, sample at the loop target
+        sample_point(&a, c->code + offset + size - operand);
+        jump(&a, JMP, offset + size - operand);
+      break; case OP_JUMP_IF_FALSE:
+        stack_top(&a);
+        jump_if_falsey(&a, -VALUE_SIZE, offset + size + operand);
+      break; case OP_POP_JUMP_IF_FALSE:
+        adjust_stack(&a, -1);
+        stack_top(&a);
+        jump_if_falsey(&a, 0, offset + size + operand);
+      break; case OP_CALL:
+        sample_point(&a, next);
+        save_ip(&a, next);
+        arg_imm(&a, RDI, ip[1]);
+        call_helper(&a, jit_call);
+        check_helper(&a);
+      break; case OP_TAIL_CALL:
+        sample_point(&a, next);
+        save_ip(&a, next);
+        emit(&a, 0x48); emit(&a, 0x89); emit(&a, 0xdf); // mov rdi, rbx
+        arg_imm(&a, RSI, ip[1]);
+        call_helper(&a, jit_tail_call);
+        emit(&a, 0x83); emit(&a, 0xf8); emit(&a, JIT_ERROR); // cmp eax, imm8
+        jump(&a, CC_E, EXIT(JIT_ERROR));
+        emit(&a, 0x83); emit(&a, 0xf8); emit(&a, JIT_TAIL_CALLED);
+        jump(&a, CC_E, EXIT(JIT_TAIL_CALLED));
+      break; case OP_RETURN:
+        emit(&a, 0x48); emit(&a, 0x89); emit(&a, 0xdf); // mov rdi, rbx
+        call_helper(&a, jit_return);
+        jump(&a, JMP, EXIT(JIT_RETURNED));
+      break; default:
+        free_assembler(&a, c->count);
+        return NULL;
+    }
+    offset += size;
+  }
+
+  int exits[EXIT_COUNT];
+  for (int status = 0; status < EXIT_COUNT; status++)
+  {
+    exits[status] = a.count;
+    exit_with(&a, (jit_status)status);
+  }
+
+  for (int i = 0; i < a.fixup_count; i++)
+  {
+    fixup* f = &a.fixups[i];
+    int target = -1;
+    if (f->target < c->count)
+    {
+      target = f->target >= 0 ? a.entries[f->target] : exits[EXIT(f->target)];
+    }
+    if (target < 0)
+    {
+      free_assembler(&a, c->count);
+      return NULL;
+    }
+    patch32(&a, f->at, target - (f->at + 4));
+  }
+
+  void* memory = mmap(NULL, a.count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+  {
+    free_assembler(&a, c->count);
+    return NULL;
+  }
+  memcpy(memory, a.code, a.count);
+  if (mprotect(memory, a.count, PROT_READ | PROT_EXEC) != 0)
+  {
+    munmap(memory, a.count);
+    free_assembler(&a, c->count);
+    return NULL;
+  }
+
+  jit_code* code = ALLOCATE(jit_code, 1);
+  code->memory = memory;
+  code->size = a.count;
+  code->entries = a.entries;
+  code->entry_count = c->count;
+  FREE_ARRAY(uint8_t, a.code, a.capacity);
+  FREE_ARRAY(fixup, a.fixups, a.fixup_capacity);
+  return code;
+}
+
+bool jit_ready(obj_function* func)
+{
+  if (func->jit != NULL) return true;
+  if (func->hotness < 0 || ++func->hotness < JIT_THRESHOLD) return false;
+
+  // the assembler's buffers can't be unwound half way
+  g_vm.limit_suspended++;
+  func->jit = compile_function(func);
+  g_vm.limit_suspended--;
+  if (func->jit == NULL) func->hotness = -1; // don't try again
+  return func->jit != NULL;
+}
+
+jit_status jit_enter(call_frame* frame)
+{
+  jit_code* code = frame->function->jit;
+  int offset = code->entries[frame->ip - frame->function->chunk.code];
+  native_entry entry = (native_entry)(void*)code->memory;
+  return entry(frame, code->memory + offset);
+}
+
+void free_jit_code(obj_function* func)
+{
+  jit_code* code = func->jit;
+  if (code == NULL) return;
+  munmap(code->memory, code->size);
+  FREE_ARRAY(int, code->entries, code->entry_count);
+  FREE(jit_code, code);
+  func->jit = NULL;
+}
+
+#endif
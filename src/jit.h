@@ -0,0 +1,37 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// calls and loop back-edges a function runs through in the interpreter
+// before it gets translated to machine code
+#define JIT_THRESHOLD 1000
+
+typedef enum {
+  JIT_RETURNED,   // the frame returned, its result is on the stack
+  JIT_ERROR,      // a runtime error was reported and the stack is reset
+  JIT_TAIL_CALLED // the frame runs a different function now
+} jit_status;
+
+typedef struct jit_code jit_code;
+
+bool jit_ready(obj_function* func);
+jit_status jit_enter(call_frame* frame);
+void free_jit_code(obj_function* func);
+
+// slow paths the generated code calls back into, they live in vm.c next
+// to the instructions they stand in for
+bool jit_binary(uint8_t op);
+bool jit_unary(uint8_t op);
+bool jit_global(uint8_t op, uint16_t slot);
+bool jit_call(int arg_count);
+jit_status jit_tail_call(call_frame* frame, int arg_count);
+void jit_return(call_frame* frame);
+
+#endif
+
+#endif
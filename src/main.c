@@ -6,6 +6,10 @@
 #include "chunk.h"
 
 #include "debug.h"
+#include "memory.h"
+#include "pool.h"
+#include "profiler.h"
+#include "stats.h"
 #include "vm.h"
 
 static void repl()
@@ -54,34 +58,145 @@ static char* read_file(const char* path)
   return buffer;
 }
 
-static void run_file(const char* path) 
+static interpret_result run_file(const char* path) 
 {
   char* source = read_file(path);
   interpret_result result = interpret(source);
   free(source);
+  return result;
+}
 
-  if (result == INTERPRET_COMPILE_ERROR) { exit(65); }
-  if (result == INTERPRET_RUNTIME_ERROR) { exit(70); }
+// bytes with an optional k, m or g suffix, 0 if it doesn't parse
+static size_t parse_size(const char* text)
+{
+  char* end;
+  unsigned long long size = strtoull(text, &end, 10);
+  if (end == text) { return 0; }
+  switch (*end)
+  {
+    case 'k': case 'K': size <<= 10; end++;
+    break; case 'm': case 'M': size <<= 20; end++;
+    break; case 'g': case 'G': size <<= 30; end++;
+  }
+  return *end == '\0' ? (size_t)size : 0;
 }
 
 int main(int argc, const char* argv[])
 {
+  // init_vm() already allocates and interns, the allocator and the hash
+  // seed have to be picked before
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--allocator=pool") == 0) g_pool.enabled = true;
+    else if (strcmp(argv[i], "--allocator=libc") == 0) g_pool.enabled = false;
+    else if (strncmp(argv[i], "--hash-seed=", 12) == 0) g_vm.hash_seed = strtoull(argv[i] + 12, NULL, 0);
+  }
   init_vm();
 
-  if (argc == 1) 
+  const char* path = NULL;
+  const char* profile = NULL;
+  bool alloc_stats = false;
+#ifdef VM_STATS
+  bool stats = false;
+#endif
+  for (int i = 1; i < argc; i++)
   {
-    repl();
+    if (strcmp(argv[i], "--no-jit") == 0)
+    {
+      g_vm.jit_enabled = false;
+    }
+    else if (strcmp(argv[i], "--stats") == 0)
+    {
+#ifdef VM_STATS
+      // machine code doesn't count, keep everything in the interpreter
+      stats = true;
+      g_vm.jit_enabled = false;
+#else
+      fprintf(stderr, "--stats needs a build with CLOX_STATS.\n");
+      exit(64);
+#endif
+    }
+    else if (strncmp(argv[i], "--profile=", 10) == 0)
+    {
+#ifdef PROFILER
+      profile = argv[i] + 10;
+#else
+      fprintf(stderr, "--profile needs a build with CLOX_PROFILER.\n");
+      exit(64);
+#endif
+    }
+    else if (strcmp(argv[i], "--gc=incremental") == 0)
+    {
+      g_vm.gc_mode = GC_INCREMENTAL;
+    }
+    else if (strcmp(argv[i], "--gc=stw") == 0)
+    {
+      g_vm.gc_mode = GC_STOP_THE_WORLD;
+    }
+    else if (strncmp(argv[i], "--gc-budget=", 12) == 0 && atol(argv[i] + 12) > 0)
+    {
+      g_vm.gc_budget = (size_t)atol(argv[i] + 12);
+    }
+    else if (strcmp(argv[i], "--gc-stats") == 0)
+    {
+      g_vm.gc_stats = true;
+    }
+    else if (strncmp(argv[i], "--heap-limit=", 13) == 0 && parse_size(argv[i] + 13) > 0)
+    {
+      set_heap_limit(parse_size(argv[i] + 13));
+    }
+    else if (strcmp(argv[i], "--alloc-stats") == 0)
+    {
+      alloc_stats = true;
+    }
+    else if (strcmp(argv[i], "--allocator=pool") == 0 || strcmp(argv[i], "--allocator=libc") == 0
+          || strncmp(argv[i], "--hash-seed=", 12) == 0)
+    {
+      // picked before init_vm()
+    }
+    else if (path == NULL && argv[i][0] != '-')
+    {
+      path = argv[i];
+    }
+    else
+    {
+      fprintf(stderr, "Usage: clox [--no-jit] [--stats] [--profile=out.folded] "
+                      "[--gc=stw|incremental] [--gc-budget=n] [--gc-stats] "
+                      "[--heap-limit=n[k|m|g]] [--allocator=pool|libc] [--alloc-stats] "
+                      "[--hash-seed=n] [path]\n");
+      exit(64);
+    }
+  }
+
+#ifdef PROFILER
+  if (profile != NULL && !start_profiler(profile))
+  {
+    fprintf(stderr, "Could not start the profiler.\n");
+    exit(71);
   }
-  else if (argc == 2)
+#endif
+
+  interpret_result result = INTERPRET_OK;
+  if (path == NULL) 
   {
-    run_file(argv[1]);
+    repl();
   }
-  else 
+  else
   {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    result = run_file(path);
   }
 
+#ifdef PROFILER
+  if (profile != NULL) stop_profiler();
+#endif
+#ifdef VM_STATS
+  if (stats) print_stats(stderr);
+#endif
+  if (g_vm.gc_stats) print_gc_stats(stderr);
+  if (alloc_stats) print_pool_stats(stderr);
+  if (result == INTERPRET_COMPILE_ERROR) { exit(65); }
+  if (result == INTERPRET_RUNTIME_ERROR) { exit(70); }
+
   free_vm();
   return 0;
 }
\ No newline at end of file
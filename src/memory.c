@@ -1,22 +1,148 @@
+#include <setjmp.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "pool.h"
+#include "stats.h"
 #include "vm.h"
 
+static void collect_if_needed();
+
+// pauses nest: a full collection runs a minor one, both count as one pause
+static int g_pause_depth = 0;
+static uint64_t g_pause_start = 0;
+
+static bool over_limit(size_t growth)
+{
+  return g_vm.heap_limit != 0 && g_vm.limit_suspended == 0
+    && g_vm.bytes_allocated + growth > g_vm.heap_limit;
+}
+
+// unwinds to interpret() while a script runs, anywhere else there is no
+// way back
+static void out_of_memory()
+{
+  if (g_vm.heap_handler == NULL || g_vm.limit_suspended > 0)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+  // a collection that gives up half way isn't recorded as a pause
+  g_pause_depth = 0;
+  longjmp(*g_vm.heap_handler, 1);
+}
+
+// a last full collection before `bytes` more would go over the limit,
+// only for callers that hold nothing unrooted
+void reserve_heap(size_t bytes)
+{
+  if (over_limit(bytes)) { collect_garbage(); }
+}
+
 void* reallocate (void* pointer, size_t old_size, size_t new_size)
 {
+  if (new_size > old_size && over_limit(new_size - old_size))
+  {
+#ifndef GENERATIONAL_GC
+    // nothing moves without a nursery, any allocation may collect
+    collect_garbage();
+#endif
+    if (over_limit(new_size - old_size)) { out_of_memory(); }
+  }
+#ifdef VM_STATS
+  if (new_size > old_size)
+  {
+    g_stats.allocations++;
+    g_stats.bytes_allocated += new_size - old_size;
+  }
+  else
+  {
+    g_stats.bytes_freed += old_size - new_size;
+  }
+#endif
+  g_vm.bytes_allocated += new_size - old_size;
+  if (g_vm.bytes_allocated > g_vm.heap_peak) { g_vm.heap_peak = g_vm.bytes_allocated; }
+#ifndef GENERATIONAL_GC
+  // with a nursery objects move, collections only start in allocate_young
+  // and allocate_old where no caller holds on to an unrooted object
+  if (new_size > old_size) { collect_if_needed(); }
+#endif
+
   if (new_size == 0)
   {
-    free(pointer);
+    pool_free(pointer, old_size);
     return NULL;
   }
-  void* result = realloc(pointer, new_size);
-  if (result == NULL) { exit(1); }
+  void* result = pool_realloc(pointer, old_size, new_size);
+  if (result == NULL)
+  {
+    g_vm.bytes_allocated -= new_size - old_size;
+    out_of_memory();
+  }
   return result;
 }
 
 
-void free_object(obj* object)
+void mark_object(obj* object)
+{
+  if (object == NULL || object->is_marked) { return; }
+#ifdef GENERATIONAL_GC
+  // young objects are promoted black by the minor collection that ends
+  // marking, is_marked means forwarded for them
+  if (is_young(object)) { return; }
+#endif
+  object->is_marked = true;
+
+  if (g_vm.gray_capacity < g_vm.gray_count + 1)
+  {
+    // the gray stack lives outside the managed heap so growing it can't
+    // start another collection
+    g_vm.gray_capacity = GROW_CAPACITY(g_vm.gray_capacity);
+    g_vm.gray_stack = (obj**)realloc(g_vm.gray_stack, sizeof(obj*) * g_vm.gray_capacity);
+    if (g_vm.gray_stack == NULL) { exit(1); }
+  }
+  g_vm.gray_stack[g_vm.gray_count++] = object;
+}
+
+void mark_value(value v)
+{
+  if (IS_OBJ(v)) { mark_object(AS_OBJ(v)); }
+}
+
+static void mark_array(value_array* array)
+{
+  for (int i = 0; i < array->count; i++)
+  {
+    mark_value(array->values[i]);
+  }
+}
+
+static void blacken_object(obj* object)
+{
+  switch (object->type)
+  {
+    case OBJ_FUNCTION:
+    {
+      obj_function* func = (obj_function*)object;
+      mark_object((obj*)func->name);
+      mark_array(&func->chunk.constants);
+    }
+    break; case OBJ_NATIVE:
+    break; case OBJ_STRING:
+    break; case OBJ_ROPE:
+    {
+      obj_rope* rope = (obj_rope*)object;
+      mark_object(rope->left);
+      mark_object(rope->right);
+      mark_object((obj*)rope->flat);
+    }
+  }
+}
+
+static void free_object(obj* object)
 {
   switch (object->type)
   {
@@ -24,29 +150,614 @@ void free_object(obj* object)
     case OBJ_FUNCTION:
     {
       obj_function* func = (obj_function*)object; 
+#ifdef JIT
+      free_jit_code(func);
+#endif
       free_chunk(&func->chunk);
       FREE(obj_function, object);
     } 
     break; case OBJ_NATIVE:
     {
-      printf("<native fn>");
+      FREE(obj_native, object);
     }
     break; case OBJ_STRING: 
     {
-      obj_string* str = (obj_string*)object;
-      FREE_ARRAY(char, str->chars, str->length+1);
-      FREE(obj_string, object);
+      reallocate(object, string_size(((obj_string*)object)->length), 0);
+    }
+    break; case OBJ_ROPE:
+    {
+      FREE(obj_rope, object);
     }
   }
 }
 
 void free_objects()
 {
-  obj* object = g_vm.objects;
-  while (object != NULL)
+#ifdef GENERATIONAL_GC
+  free(g_vm.nursery);
+  g_vm.nursery = g_vm.nursery_top = g_vm.nursery_end = NULL;
+#endif
+  obj* lists[] = { g_vm.objects, g_vm.sweeping };
+  for (int i = 0; i < 2; i++)
+  {
+    obj* object = lists[i];
+    while (object != NULL)
+    {
+      obj* next = object->next;
+      free_object(object);
+      object = next;
+    }
+  }
+  g_vm.objects = g_vm.sweeping = NULL;
+}
+
+static void mark_roots()
+{
+  for (value* slot = g_vm.stack; slot < g_vm.stack_top; slot++)
+  {
+    mark_value(*slot);
+  }
+  for (int i = 0; i < g_vm.frame_count; i++)
+  {
+    mark_object((obj*)g_vm.frames[i].function);
+  }
+  mark_array(&g_vm.global_names);
+  mark_array(&g_vm.global_values);
+  mark_table(&g_vm.global_slots);
+  mark_compiler_roots();
+}
+
+// blackens at most `budget` gray objects, true once none are left
+static bool trace_references(size_t budget)
+{
+  while (g_vm.gray_count > 0 && budget-- > 0)
+  {
+    blacken_object(g_vm.gray_stack[--g_vm.gray_count]);
+  }
+  return g_vm.gray_count == 0;
+}
+
+// frees the unmarked objects among the next `budget` of the sweep list,
+// true once it is empty. survivors go back to g_vm.objects, which only
+// holds objects allocated since marking finished until then
+static bool sweep(size_t budget)
+{
+  while (g_vm.sweeping != NULL && budget-- > 0)
+  {
+    obj* object = g_vm.sweeping;
+    g_vm.sweeping = object->next;
+    if (object->is_marked)
+    {
+      object->is_marked = false;
+      object->next = g_vm.objects;
+      g_vm.objects = object;
+    }
+    else
+    {
+      free_object(object);
+    }
+  }
+  return g_vm.sweeping == NULL;
+}
+
+static void begin_pause()
+{
+  if (g_vm.gc_stats && g_pause_depth++ == 0) { g_pause_start = clock_ns(); }
+}
+
+static void end_pause()
+{
+  if (g_vm.gc_stats && --g_pause_depth == 0) { record_pause(clock_ns() - g_pause_start); }
+}
+
+static void start_marking()
+{
+  g_vm.gc_phase = GC_MARKING;
+  mark_roots();
+}
+
+#ifdef GENERATIONAL_GC
+// old objects that died since they were remembered are about to be swept,
+// the next minor collection must not look at them
+static void forget_dead_owners()
+{
+  int live = 0;
+  for (int i = 0; i < g_vm.remembered_count; i++)
+  {
+    obj* owner = g_vm.remembered[i];
+    if (owner->is_marked) { g_vm.remembered[live++] = owner; }
+  }
+  g_vm.remembered_count = live;
+}
+#endif
+
+// the roots were not behind a barrier while marking ran in steps, so they
+// are marked once more and everything they reach is traced in one go.
+// only then is it known which strings are dead
+static void finish_marking(bool promote_young)
+{
+#ifdef GENERATIONAL_GC
+  // survivors of the nursery are promoted black, afterwards nothing young
+  // is left that the string table could still refer to. without promoting,
+  // the young strings are left alone: they reference nothing and the
+  // string table skips them
+  if (promote_young) { collect_young(); }
+#else
+  (void)promote_young;
+#endif
+  mark_roots();
+  trace_references(SIZE_MAX);
+#ifdef GENERATIONAL_GC
+  if (!promote_young) { forget_dead_owners(); }
+#endif
+  g_vm.strings_cursor = 0;
+  g_vm.strings_generation = g_vm.strings.generation;
+  g_vm.sweeping = g_vm.objects;
+  g_vm.objects = NULL;
+  g_vm.gc_phase = GC_SWEEPING;
+}
+
+// the string table holds its strings weakly, the ones marking didn't reach
+// are dropped in steps before the sweep frees them. new strings are black
+// until then and a lookup that finds a dead one revives it
+static bool clear_strings(size_t budget)
+{
+  table* t = &g_vm.strings;
+  // done, the sweep unmarks what survives so this mustn't run again
+  if (g_vm.strings_cursor < 0) { return true; }
+  if (t->generation != g_vm.strings_generation)
+  {
+    // an insert resized or rehashed the table and moved the entries,
+    // start over
+    g_vm.strings_cursor = 0;
+    g_vm.strings_generation = t->generation;
+  }
+  while (g_vm.strings_cursor < t->capacity && budget-- > 0)
+  {
+    entry* e = &t->entries[g_vm.strings_cursor++];
+    if (e->key == NULL || e->key->object.is_marked) { continue; }
+#ifdef GENERATIONAL_GC
+    if (is_young((obj*)e->key)) { continue; }
+#endif
+    table_delete(t, e->key);
+  }
+  if (g_vm.strings_cursor < t->capacity) { return false; }
+  g_vm.strings_cursor = -1;
+  return true;
+}
+
+static void finish_sweeping()
+{
+  g_vm.gc_phase = GC_IDLE;
+  g_vm.gc_cycles++;
+#ifdef VM_STATS
+  g_stats.collections++;
+#endif
+  g_vm.next_gc = g_vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  if (g_vm.next_gc < GC_MIN_HEAP) { g_vm.next_gc = GC_MIN_HEAP; }
+  if (g_vm.heap_limit != 0 && g_vm.next_gc > g_vm.heap_limit) { g_vm.next_gc = g_vm.heap_limit; }
+}
+
+// one slice of an incremental cycle
+static void gc_step()
+{
+  begin_pause();
+  if (g_vm.gc_phase == GC_MARKING)
   {
-    obj* next = object->next;
+    if (trace_references(g_vm.gc_budget)) { finish_marking(true); }
+  }
+  else if (clear_strings(g_vm.gc_budget) && sweep(g_vm.gc_budget))
+  {
+    finish_sweeping();
+  }
+  end_pause();
+}
+
+// runs a whole cycle over the old space, or what is left of the one in
+// progress. the nursery stays as it is
+static void collect_old()
+{
+  if (g_vm.gc_phase == GC_IDLE) { start_marking(); }
+  if (g_vm.gc_phase == GC_MARKING) { finish_marking(false); }
+  clear_strings(SIZE_MAX);
+  sweep(SIZE_MAX);
+  finish_sweeping();
+}
+
+// the old space goes first so the promotion afterwards has the most room
+void collect_garbage()
+{
+  begin_pause();
+  collect_old();
+#ifdef GENERATIONAL_GC
+  collect_young();
+#endif
+  end_pause();
+}
+
+// called before an allocation, the only place the collector runs
+static void collect_if_needed()
+{
+  if (g_vm.gc_phase != GC_IDLE)
+  {
+    gc_step();
+    return;
+  }
+#ifndef DEBUG_STRESS_GC
+  if (g_vm.bytes_allocated <= g_vm.next_gc) { return; }
+#endif
+  if (g_vm.gc_mode == GC_INCREMENTAL)
+  {
+    begin_pause();
+    start_marking();
+    end_pause();
+  }
+  else
+  {
+    collect_garbage();
+  }
+}
+
+obj* allocate_old(size_t size, obj_type type)
+{
+#ifdef GENERATIONAL_GC
+  collect_if_needed();
+  reserve_heap(size);
+#endif
+  obj* object = (obj*)reallocate(NULL, 0, size);
+  // objects allocated while marking are black, the barrier shades what
+  // gets stored in them afterwards. strings allocated while sweeping are
+  // black too so clearing the string table keeps them, at worst they
+  // survive one cycle too long
+  object->type = type;
+  object->is_marked = g_vm.gc_phase == GC_MARKING 
+    || (g_vm.gc_phase == GC_SWEEPING && type == OBJ_STRING);
+#ifdef GENERATIONAL_GC
+  object->is_remembered = false;
+#endif
+  object->next = g_vm.objects;
+  g_vm.objects = object;
+  return object;
+}
+
+// takes back the last allocation, a string that turned out to be interned
+// already. if something was allocated since, the collector gets it later
+void free_newest(obj* object, size_t size)
+{
+#ifdef GENERATIONAL_GC
+  if (is_young(object))
+  {
+    if ((uint8_t*)object + NURSERY_ALIGN(size) == g_vm.nursery_top)
+    {
+      g_vm.nursery_top = (uint8_t*)object;
+    }
+    return;
+  }
+#endif
+  if (g_vm.objects == object)
+  {
+    g_vm.objects = object->next;
     free_object(object);
-    object = next;
   }
 }
+
+#ifdef GENERATIONAL_GC
+
+obj* allocate_young(size_t size)
+{
+  size = NURSERY_ALIGN(size);
+  if (g_vm.nursery_top + size > g_vm.nursery_end) { collect_young(); }
+  // long strings grow the heap through their characters long before their
+  // headers fill the nursery, and promotion adds to the old space as well
+  collect_if_needed();
+  obj* object = (obj*)g_vm.nursery_top;
+  g_vm.nursery_top += size;
+#ifdef VM_STATS
+  g_stats.young_bytes += size;
+#endif
+  object->is_marked = false;
+  object->is_remembered = false;
+  object->next = NULL;
+  return object;
+}
+
+// the remembered sets live outside the managed heap like the gray stack
+void remember_object(obj* owner)
+{
+  if (g_vm.remembered_capacity < g_vm.remembered_count + 1)
+  {
+    g_vm.remembered_capacity = GROW_CAPACITY(g_vm.remembered_capacity);
+    g_vm.remembered = (obj**)realloc(g_vm.remembered, sizeof(obj*) * g_vm.remembered_capacity);
+    if (g_vm.remembered == NULL) { exit(1); }
+  }
+  owner->is_remembered = true;
+  g_vm.remembered[g_vm.remembered_count++] = owner;
+}
+
+void remember_global(int slot)
+{
+  if (g_vm.remembered_globals_capacity < g_vm.remembered_globals_count + 1)
+  {
+    g_vm.remembered_globals_capacity = GROW_CAPACITY(g_vm.remembered_globals_capacity);
+    g_vm.remembered_globals = (int*)realloc(g_vm.remembered_globals, 
+      sizeof(int) * g_vm.remembered_globals_capacity);
+    if (g_vm.remembered_globals == NULL) { exit(1); }
+  }
+  g_vm.global_remembered[slot] = true;
+  g_vm.remembered_globals[g_vm.remembered_globals_count++] = slot;
+}
+
+static size_t object_size(obj* object)
+{
+  switch (object->type)
+  {
+    case OBJ_FUNCTION: return sizeof(obj_function);
+    case OBJ_NATIVE:   return sizeof(obj_native);
+    case OBJ_STRING:   return string_size(((obj_string*)object)->length);
+    case OBJ_ROPE:     return sizeof(obj_rope);
+  }
+  return 0;
+}
+
+// copies a young object into the old space once and leaves its new
+// address behind. only strings are young and they reference nothing,
+// so promoting one never makes more work
+static obj* promote(obj* object)
+{
+  if (object->is_marked) { return object->next; }
+
+  size_t size = object_size(object);
+  obj* copy = (obj*)reallocate(NULL, 0, size);
+  memcpy(copy, object, size);
+  copy->is_marked = g_vm.gc_phase != GC_IDLE;
+  copy->next = g_vm.objects;
+  g_vm.objects = copy;
+  object->is_marked = true;
+  object->next = copy;
+#ifdef VM_STATS
+  g_stats.promoted_bytes += size;
+#endif
+  return copy;
+}
+
+static void evacuate(value* slot)
+{
+  if (IS_OBJ(*slot) && is_young(AS_OBJ(*slot)))
+  {
+    *slot = OBJ_VAL(promote(AS_OBJ(*slot)));
+  }
+}
+
+static void evacuate_object(obj** field)
+{
+  if (*field != NULL && is_young(*field)) { *field = promote(*field); }
+}
+
+static void evacuate_fields(obj* object)
+{
+  switch (object->type)
+  {
+    case OBJ_FUNCTION:
+    {
+      obj_function* func = (obj_function*)object;
+      if (func->name != NULL && is_young((obj*)func->name))
+      {
+        func->name = (obj_string*)promote((obj*)func->name);
+      }
+      for (int i = 0; i < func->chunk.constants.count; i++)
+      {
+        evacuate(&func->chunk.constants.values[i]);
+      }
+    }
+    break; case OBJ_NATIVE:
+    break; case OBJ_STRING:
+    break; case OBJ_ROPE:
+    {
+      obj_rope* rope = (obj_rope*)object;
+      evacuate_object(&rope->left);
+      evacuate_object(&rope->right);
+      evacuate_object((obj**)&rope->flat);
+    }
+  }
+  object->is_remembered = false;
+}
+
+static void evacuate_global(int slot)
+{
+  evacuate(&g_vm.global_values.values[slot]);
+
+  // the slot table is keyed by the name object itself
+  value* name = &g_vm.global_names.values[slot];
+  obj_string* young = AS_STRING(*name);
+  evacuate(name);
+  if (AS_STRING(*name) != young)
+  {
+    table_replace_key(&g_vm.global_slots, young, AS_STRING(*name));
+  }
+  g_vm.global_remembered[slot] = false;
+}
+
+// every string is interned, so the weak string table has an entry for
+// each one in the nursery: survivors get their new address, the rest
+// are dropped
+static void sweep_nursery()
+{
+  uint8_t* p = g_vm.nursery;
+  while (p < g_vm.nursery_top)
+  {
+    obj_string* str = (obj_string*)p;
+    p += NURSERY_ALIGN(string_size(str->length));
+    if (str->object.is_marked)
+    {
+      table_replace_key(&g_vm.strings, str, (obj_string*)str->object.next);
+    }
+    else
+    {
+      table_delete(&g_vm.strings, str);
+    }
+  }
+  g_vm.nursery_top = g_vm.nursery;
+}
+
+static size_t count_young(obj* object)
+{
+  if (object == NULL || !is_young(object) || object->is_remembered) { return 0; }
+  // is_remembered means nothing for young objects, it marks the counted
+  object->is_remembered = true;
+  return object_size(object);
+}
+
+static size_t count_young_value(value v)
+{
+  return IS_OBJ(v) ? count_young(AS_OBJ(v)) : 0;
+}
+
+// what promoting the nursery would add to the old space, found from the
+// same roots collect_young() evacuates without copying anything
+static size_t surviving_bytes()
+{
+  size_t bytes = 0;
+  for (value* slot = g_vm.stack; slot < g_vm.stack_top; slot++)
+  {
+    bytes += count_young_value(*slot);
+  }
+  for (int i = 0; i < g_vm.remembered_count; i++)
+  {
+    obj* owner = g_vm.remembered[i];
+    if (owner->type == OBJ_FUNCTION)
+    {
+      obj_function* func = (obj_function*)owner;
+      bytes += count_young((obj*)func->name);
+      for (int c = 0; c < func->chunk.constants.count; c++)
+      {
+        bytes += count_young_value(func->chunk.constants.values[c]);
+      }
+    }
+    else if (owner->type == OBJ_ROPE)
+    {
+      obj_rope* rope = (obj_rope*)owner;
+      bytes += count_young(rope->left) + count_young(rope->right)
+        + count_young((obj*)rope->flat);
+    }
+  }
+  for (int i = 0; i < g_vm.remembered_globals_count; i++)
+  {
+    int slot = g_vm.remembered_globals[i];
+    bytes += count_young_value(g_vm.global_values.values[slot])
+      + count_young_value(g_vm.global_names.values[slot]);
+  }
+
+  for (uint8_t* p = g_vm.nursery; p < g_vm.nursery_top; )
+  {
+    obj_string* str = (obj_string*)p;
+    str->object.is_remembered = false;
+    p += NURSERY_ALIGN(string_size(str->length));
+  }
+  return bytes;
+}
+
+// promotion can't stop half way, so the limit is only suspended once the
+// survivors are known to fit into the old space. otherwise the old space
+// is collected first, and if that's not enough the allocation fails
+void collect_young()
+{
+  if (g_vm.heap_limit != 0 && over_limit(surviving_bytes()))
+  {
+    collect_old();
+    if (over_limit(surviving_bytes())) { out_of_memory(); }
+  }
+  begin_pause();
+  g_vm.limit_suspended++;
+#ifdef VM_STATS
+  uint64_t start = clock_ns();
+  g_stats.minor_collections++;
+#endif
+  for (value* slot = g_vm.stack; slot < g_vm.stack_top; slot++)
+  {
+    evacuate(slot);
+  }
+  for (int i = 0; i < g_vm.remembered_count; i++)
+  {
+    evacuate_fields(g_vm.remembered[i]);
+  }
+  for (int i = 0; i < g_vm.remembered_globals_count; i++)
+  {
+    evacuate_global(g_vm.remembered_globals[i]);
+  }
+  g_vm.remembered_count = 0;
+  g_vm.remembered_globals_count = 0;
+  sweep_nursery();
+#ifdef VM_STATS
+  uint64_t pause = clock_ns() - start;
+  g_stats.minor_ns += pause;
+  if (pause > g_stats.max_minor_ns) { g_stats.max_minor_ns = pause; }
+#endif
+  g_vm.minor_collections++;
+  g_vm.limit_suspended--;
+  end_pause();
+}
+
+#endif
+
+// pause times in buckets of an eighth of a power of two, precise enough
+// for percentiles without keeping every sample
+#define PAUSE_BUCKETS (64 * 8)
+
+static uint64_t g_pauses[PAUSE_BUCKETS];
+static uint64_t g_pause_count = 0;
+static uint64_t g_pause_total = 0;
+static uint64_t g_pause_max = 0;
+
+static int pause_bucket(uint64_t ns)
+{
+  if (ns < 8) { return (int)ns; }
+  int log2 = 63 - __builtin_clzll(ns);
+  return log2 * 8 + (int)((ns >> (log2 - 3)) & 7);
+}
+
+// the largest pause that falls into `bucket`
+static uint64_t bucket_limit(int bucket)
+{
+  if (bucket < 8) { return (uint64_t)bucket; }
+  int log2 = bucket / 8;
+  return ((uint64_t)(8 + bucket % 8 + 1) << (log2 - 3)) - 1;
+}
+
+void record_pause(uint64_t ns)
+{
+  g_pauses[pause_bucket(ns)]++;
+  g_pause_count++;
+  g_pause_total += ns;
+  if (ns > g_pause_max) { g_pause_max = ns; }
+}
+
+static double percentile(double p)
+{
+  uint64_t rank = (uint64_t)(p * g_pause_count);
+  uint64_t seen = 0;
+  for (int i = 0; i < PAUSE_BUCKETS; i++)
+  {
+    seen += g_pauses[i];
+    if (seen > rank) 
+    { 
+      uint64_t limit = bucket_limit(i);
+      return (limit < g_pause_max ? limit : g_pause_max) / 1000.0;
+    }
+  }
+  return g_pause_max / 1000.0;
+}
+
+void print_gc_stats(FILE* out)
+{
+  fprintf(out, "{\"mode\": \"%s\", \"budget\": %zu, \"cycles\": %llu, \"minor_collections\": %llu, "
+               "\"pauses\": %llu, \"total_ms\": %.3f, \"max_us\": %.1f, "
+               "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+               "\"heap_peak\": %zu, \"heap_limit\": %zu, "
+               "\"strings\": %d, \"string_tombstones\": %d, \"string_capacity\": %d}\n",
+          g_vm.gc_mode == GC_INCREMENTAL ? "incremental" : "stw", g_vm.gc_budget,
+          (unsigned long long)g_vm.gc_cycles, (unsigned long long)g_vm.minor_collections,
+          (unsigned long long)g_pause_count, g_pause_total / 1e6, g_pause_max / 1000.0,
+          percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999),
+          g_vm.heap_peak, g_vm.heap_limit,
+          g_vm.strings.count, g_vm.strings.tombstones, g_vm.strings.capacity);
+}
@@ -1,8 +1,11 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
   (type*)reallocate(NULL, 0, sizeof(type)*(count))
@@ -18,7 +21,80 @@
 #define GROW_ARRAY(type, pointer, old_count, new_count) \
   (type*)reallocate(pointer, sizeof(type) * (old_count), sizeof(type) * (new_count));
 
+// the next collection runs once the heap grew by this factor over what
+// survived the last one, but never below GC_MIN_HEAP bytes
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP (1024 * 1024)
+
+// incremental cycles mark and sweep this many objects per allocation
+#define GC_STEP_BUDGET 256
+
 void* reallocate (void* pointer, size_t old_size, size_t new_size);
+obj* allocate_old(size_t size, obj_type type);
+void mark_object(obj* object);
+void mark_value(value v);
+void collect_garbage();
+void reserve_heap(size_t bytes);
+void free_newest(obj* object, size_t size);
 void free_objects();
+void record_pause(uint64_t ns);
+void print_gc_stats(FILE* out);
+
+#ifdef GENERATIONAL_GC
+
+// new strings are bump allocated in the nursery. a minor collection copies
+// the ones still reachable into the old space, which is the malloc heap
+// linked through g_vm.objects, and empties the nursery. only allocating
+// an object can collect, so pointers held across anything else stay valid
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+#define NURSERY_MAX_OBJECT (4 * 1024) // larger strings start out old
+
+obj* allocate_young(size_t size);
+void collect_young();
+void remember_object(obj* owner);
+void remember_global(int slot);
+
+static inline bool is_young(obj* object)
+{
+  return (uint8_t*)object >= g_vm.nursery && (uint8_t*)object < g_vm.nursery_top;
+}
+
+// a minor collection only scans the old objects and global slots that
+// were recorded here. the value stack is scanned as a whole
+static inline void global_barrier(int slot, value v)
+{
+  if (IS_OBJ(v) && is_young(AS_OBJ(v)) && !g_vm.global_remembered[slot])
+  {
+    remember_global(slot);
+  }
+}
+
+#endif
+
+// interning hands out a string again, keep the sweep from freeing it
+static inline void revive_string(obj_string* str)
+{
+#ifdef GENERATIONAL_GC
+  if (is_young((obj*)str)) { return; }
+#endif
+  if (g_vm.gc_phase == GC_SWEEPING) { str->object.is_marked = true; }
+}
+
+// every store of a reference into an object goes through here. while
+// marking runs in steps a black object must not end up pointing to a
+// white one, and a minor collection has to know the old objects that
+// point into the nursery. globals and the stack are roots, they are
+// rescanned instead
+static inline void write_barrier(obj* owner, value v)
+{
+  if (g_vm.gc_phase == GC_MARKING && owner->is_marked) { mark_value(v); }
+#ifdef GENERATIONAL_GC
+  if (IS_OBJ(v) && is_young(AS_OBJ(v)) && !owner->is_remembered)
+  {
+    remember_object(owner);
+  }
+#endif
+}
 
-#endif 
\ No newline at end of file
+#endif
\ No newline at end of file
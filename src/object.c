@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "memory.h"
 #include "object.h"
@@ -13,10 +15,16 @@
 
 static obj* allocate_object(size_t size, obj_type type) 
 {
-  obj* object = (obj*)reallocate(NULL, 0, size);
+#ifdef GENERATIONAL_GC
+  // strings are the short lived objects, functions and natives stay
+  // around as long as the program and go straight to the old space. so do
+  // long strings, copying them out of the nursery would cost too much
+  obj* object = type == OBJ_STRING && size <= NURSERY_MAX_OBJECT
+    ? allocate_young(size) : allocate_old(size, type);
+#else
+  obj* object = allocate_old(size, type);
+#endif
   object->type = type;
-  object->next = g_vm.objects;
-  g_vm.objects = object;
   return object;
 }
 
@@ -25,6 +33,14 @@ obj_function* new_function()
   obj_function* func = ALLOCATE_OBJ(obj_function, OBJ_FUNCTION);
   func->arity = 0;
   func->name = NULL;
+#ifdef JIT
+  func->jit = NULL;
+  func->hotness = 0;
+#endif
+#ifdef VM_STATS
+  func->calls = 0;
+  func->instructions = 0;
+#endif
   init_chunk(&func->chunk);
   return func;
 }
@@ -36,40 +52,148 @@ obj_native* new_native(native_func function)
   return native;
 }
 
-static obj_string* allocate_string(char* chars, int length, uint32_t hash)
+static obj_string* add_string(obj_string* str)
 {
-  obj_string* str = ALLOCATE_OBJ(obj_string, OBJ_STRING);
-  str->length = length;
-  str->chars = chars;
-  str->hash = hash;
+  push(OBJ_VAL(str));
+#ifdef GENERATIONAL_GC
+  // growing the table gets a last collection before the limit like any
+  // other allocation. it can move `str`, the stack has its new address
+  reserve_heap(table_insert_bytes(&g_vm.strings));
+  str = AS_STRING(g_vm.stack_top[-1]);
+#endif
   table_set(&g_vm.strings, str, NIL_VAL);
+  pop();
   return str;
 }
 
-static uint32_t hash_string(const char* key, int length)
+// wyhash's layout: 16 bytes per round folded in with a 64x64->128 bit
+// multiply, short keys are read as a few overlapping words instead of
+// byte by byte. the seed differs per vm so colliding keys can't be
+// prepared in advance
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  return lo ^ hi;
+#endif
+}
+
+static inline uint64_t read64(const uint8_t* p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t read32(const uint8_t* p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// 0 asks for a random seed. the clock and where the loader put the vm and
+// the stack are all this needs, it only has to be unknown to the script
+uint64_t make_hash_seed(uint64_t seed)
 {
-  uint32_t hash = 2166136261u;
-  for (int i = 0 ; i < length; i++)
+  if (seed == 0)
   {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    seed = ((uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec)
+         ^ (uint64_t)(uintptr_t)&g_vm ^ ((uint64_t)(uintptr_t)&t << 16);
   }
-  return hash;
+  return seed ^ hash_mix(seed ^ HASH_P0, HASH_P1);
 }
 
-obj_string* take_string(char* chars, int length)
+uint32_t hash_string(const char* key, int length)
 {
-  uint32_t hash = hash_string(chars, length);
-  obj_string* interned = table_find_string(&g_vm.strings, chars, length, hash);
-  if (interned != NULL)
+  const uint8_t* p = (const uint8_t*)key;
+  size_t n = (size_t)length;
+  uint64_t seed = g_vm.hash_seed;
+  uint64_t a, b;
+  if (n <= 16)
   {
-    FREE_ARRAY(char, chars, length+1);
-    return interned;
+    if (n >= 4)
+    {
+      size_t middle = (n >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + middle);
+      b = (read32(p + n - 4) << 32) | read32(p + n - 4 - middle);
+    }
+    else if (n > 0)
+    {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[n >> 1] << 8) | p[n - 1];
+      b = 0;
+    }
+    else
+    {
+      a = b = 0;
+    }
   }
-  else 
+  else
+  {
+    size_t i = n;
+    if (i > 48)
+    {
+      // three independent lanes keep the multiplier busy on long keys
+      uint64_t s1 = seed, s2 = seed;
+      do
+      {
+        seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+        s1 = hash_mix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ s1);
+        s2 = hash_mix(read64(p + 32) ^ HASH_P0, read64(p + 40) ^ s2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= s1 ^ s2;
+    }
+    while (i > 16)
+    {
+      seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = read64(p + i - 16);
+    b = read64(p + i - 8);
+  }
+  uint64_t hash = hash_mix(HASH_P1 ^ n, hash_mix(a ^ HASH_P1, b ^ seed));
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// room for `length` characters. the caller fills them in and hands the
+// string to intern_string() before anything else allocates
+obj_string* new_string(int length)
+{
+  obj_string* str = (obj_string*)allocate_object(string_size(length), OBJ_STRING);
+  str->length = length;
+  str->chars[length] = '\0';
+  return str;
+}
+
+// an equal string that is interned already wins, `str` is dropped again
+obj_string* intern_string(obj_string* str)
+{
+  str->hash = hash_string(str->chars, str->length);
+  obj_string* interned = table_find_string(&g_vm.strings, str->chars, str->length, str->hash);
+  if (interned != NULL)
   {
-    return allocate_string(chars, length, hash);
+    free_newest((obj*)str, string_size(str->length));
+    revive_string(interned);
+    return interned;
   }
+  return add_string(str);
 }
 obj_string* copy_string(const char* chars, int length)
 {
@@ -77,15 +201,114 @@ obj_string* copy_string(const char* chars, int length)
   obj_string* interned = table_find_string(&g_vm.strings, chars, length, hash);
   if (interned != NULL) 
   {
+    revive_string(interned);
     return interned;
   } 
   else 
   {
-    char* heap_chars = ALLOCATE(char, length+1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    obj_string* str = new_string(length);
+    memcpy(str->chars, chars, length);
+    str->hash = hash;
+    return add_string(str);
+  }
+}
+
+// a rope that was flattened already stands for its string
+static obj* rope_part(value v)
+{
+  if (IS_ROPE(v) && AS_ROPE(v)->flat != NULL) { return (obj*)AS_ROPE(v)->flat; }
+  return AS_OBJ(v);
+}
+
+// `left` and `right` are rooted slots. they are read once the rope is
+// allocated because allocating may move them
+obj_rope* new_rope(value* left, value* right)
+{
+  obj_rope* rope = ALLOCATE_OBJ(obj_rope, OBJ_ROPE);
+  rope->length = text_length(*left) + text_length(*right);
+  rope->left = rope_part(*left);
+  rope->right = rope_part(*right);
+  rope->flat = NULL;
+  write_barrier(&rope->object, OBJ_VAL(rope->left));
+  write_barrier(&rope->object, OBJ_VAL(rope->right));
+  return rope;
+}
+
+// writes the characters of `node` backwards, ending at `end`. left
+// children wait on a stack while the right ones are written, so the
+// usual s = s + piece chain never needs more than one entry
+static void copy_text(obj* node, char* end)
+{
+  obj** stack = NULL;
+  int count = 0;
+  int capacity = 0;
+  for (;;)
+  {
+    obj_rope* rope = (obj_rope*)node;
+    if (node->type == OBJ_ROPE && rope->flat == NULL)
+    {
+      if (capacity < count + 1)
+      {
+        capacity = GROW_CAPACITY(capacity);
+        stack = (obj**)realloc(stack, sizeof(obj*) * capacity);
+        if (stack == NULL) { exit(1); }
+      }
+      stack[count++] = rope->left;
+      node = rope->right;
+      continue;
+    }
+    obj_string* str = node->type == OBJ_ROPE ? rope->flat : (obj_string*)node;
+    end -= str->length;
+    memcpy(end, str->chars, str->length);
+    if (count == 0) { break; }
+    node = stack[--count];
+  }
+  free(stack);
+}
+
+// the rope has to be rooted, allocating its string may collect
+obj_string* flatten_rope(obj_rope* rope)
+{
+  if (rope->flat != NULL) { return rope->flat; }
+  reserve_heap(string_size(rope->length));
+  obj_string* str = new_string(rope->length);
+  copy_text(&rope->object, str->chars + rope->length);
+  str = intern_string(str);
+  rope->flat = str;
+  rope->left = rope->right = NULL;
+  write_barrier(&rope->object, OBJ_VAL(str));
+  return str;
+}
+
+// writes the leaves of `node` to stdout from left to right. printing
+// doesn't allocate on the heap, the pending right children wait on a
+// stack that holds one pointer per rope node at most
+static void print_text(obj* node)
+{
+  obj** stack = NULL;
+  int count = 0;
+  int capacity = 0;
+  for (;;)
+  {
+    obj_rope* rope = (obj_rope*)node;
+    if (node->type == OBJ_ROPE && rope->flat == NULL)
+    {
+      if (capacity < count + 1)
+      {
+        capacity = GROW_CAPACITY(capacity);
+        stack = (obj**)realloc(stack, sizeof(obj*) * capacity);
+        if (stack == NULL) { exit(1); }
+      }
+      stack[count++] = rope->right;
+      node = rope->left;
+      continue;
+    }
+    obj_string* str = node->type == OBJ_ROPE ? rope->flat : (obj_string*)node;
+    fwrite(str->chars, 1, str->length, stdout);
+    if (count == 0) { break; }
+    node = stack[--count];
   }
+  free(stack);
 }
 
 static void print_function(obj_function* func) 
@@ -106,5 +329,6 @@ void print_object(value v)
   {
     case OBJ_FUNCTION: print_function(AS_FUNCTION(v));
     break; case OBJ_STRING: printf("%s", AS_CSTRING(v));
+    break; case OBJ_ROPE: print_text(AS_OBJ(v));
   }
 }
\ No newline at end of file
@@ -11,21 +11,29 @@
 #define IS_STRING(v)    is_obj_type(v, OBJ_STRING)
 #define IS_FUNCTION(v)  is_obj_type(v, OBJ_FUNCTION)
 #define IS_NATIVE(v)    is_obj_type(v, OBJ_NATIVE)
+#define IS_ROPE(v)      is_obj_type(v, OBJ_ROPE)
+#define IS_TEXT(v)      (IS_STRING(v) || IS_ROPE(v))
 
 
 #define AS_STRING(v)    ((obj_string*)AS_OBJ(v))
 #define AS_CSTRING(v)   (((obj_string*)AS_OBJ(v))->chars)
 #define AS_FUNCTION(v)  ((obj_function*)AS_OBJ(v))
 #define AS_NATIVE(v)    (((obj_native*)AS_OBJ(v))->function)
+#define AS_ROPE(v)      ((obj_rope*)AS_OBJ(v))
 
 typedef enum {
   OBJ_FUNCTION,
   OBJ_NATIVE,
-  OBJ_STRING
+  OBJ_STRING,
+  OBJ_ROPE
 } obj_type;
 
 struct obj {
   obj_type type;
+  bool is_marked;     // in the nursery: copied out, next is the new address
+#ifdef GENERATIONAL_GC
+  bool is_remembered; // old object that may point into the nursery
+#endif
   struct obj* next;
 };
 
@@ -34,6 +42,14 @@ typedef struct {
   int arity;
   chunk chunk;
   obj_string* name;
+#ifdef JIT
+  struct jit_code* jit; // machine code once the function got hot
+  int hotness;          // calls and back-edges so far, -1 if it can't be compiled
+#endif
+#ifdef VM_STATS
+  uint64_t calls;
+  uint64_t instructions;
+#endif
 } obj_function;
 
 typedef value (*native_func)(int arg_count, value* args);
@@ -43,14 +59,39 @@ typedef struct {
   native_func function;
 } obj_native;
 
+// the characters follow the header in the same allocation
 struct obj_string {
   obj object;
   int length;
-  char* chars;
   uint32_t hash;
+  char chars[];
 };
 
-obj_string* take_string(char* chars, int length);
+static inline size_t string_size(int length)
+{
+  return sizeof(obj_string) + length + 1;
+}
+
+// a concatenation that hasn't been carried out yet. the characters are
+// only copied, hashed and interned once something needs the string
+// itself, so building a long string piece by piece stays linear. the
+// language can't tell ropes and strings apart
+typedef struct {
+  obj object;
+  int length;
+  obj* left;        // strings or ropes, NULL once flattened
+  obj* right;
+  obj_string* flat; // the interned string once there is one
+} obj_rope;
+
+#define ROPE_MIN_LENGTH 128 // shorter results are copied right away
+
+uint64_t make_hash_seed(uint64_t seed);
+uint32_t hash_string(const char* key, int length);
+obj_string* new_string(int length);
+obj_string* intern_string(obj_string* str);
+obj_rope* new_rope(value* left, value* right);
+obj_string* flatten_rope(obj_rope* rope);
 obj_native* new_native(native_func function);
 obj_function* new_function();
 obj_string* copy_string(const char* chars, int length);
@@ -61,4 +102,9 @@ static inline bool is_obj_type(value v, obj_type type)
   return IS_OBJ(v) && AS_OBJ(v)->type == type;
 }
 
+static inline int text_length(value v)
+{
+  return IS_ROPE(v) ? AS_ROPE(v)->length : AS_STRING(v)->length;
+}
+
 #endif 
\ No newline at end of file
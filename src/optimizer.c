@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+// the peephole pass decodes a finished chunk into a list of instructions,
+// rewrites that list and encodes it back. jumps are kept as instruction
+// indices while rewriting, offsets are only recomputed when encoding
+
+#define MAX_OPERANDS 2
+
+typedef struct {
+  int offset;
+  uint8_t op;
+  int size;
+  uint8_t operands[MAX_OPERANDS];
+  int target;     // instruction index a jump lands on, -1 otherwise
+  int line;
+  bool removed;
+  bool is_target; // something jumps here, pattern matching must not span it
+} instruction;
+
+typedef struct {
+  chunk* c;
+  instruction* code;
+  int count;      // instructions, code[count] is a sentinel for the chunk end
+} program;
+
+static bool is_jump(uint8_t op)
+{
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP 
+    || op == OP_POP_JUMP_IF_FALSE;
+}
+
+static bool is_conditional(uint8_t op)
+{
+  return op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE;
+}
+
+static bool falls_through(uint8_t op)
+{
+  return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+static uint16_t read_short(chunk* c, int offset)
+{
+  return (uint16_t)((c->code[offset] << 8) | c->code[offset+1]);
+}
+
+static void decode(program* p)
+{
+  chunk* c = p->c;
+  // maps a byte offset to the instruction starting there
+  int* index = ALLOCATE(int, c->count+1);
+  p->code = ALLOCATE(instruction, c->count+1);
+  p->count = 0;
+
+  for (int offset = 0; offset < c->count; )
+  {
+    instruction* in = &p->code[p->count];
+    in->offset = offset;
+    in->op = c->code[offset];
+    in->size = instruction_size(in->op);
+    in->target = -1;
+    in->line = c->lines[offset];
+    for (int b = 1; b < in->size; b++)
+    {
+      in->operands[b-1] = c->code[offset+b];
+    }
+    in->removed = false;
+    in->is_target = false;
+    index[offset] = p->count++;
+    offset += in->size;
+  }
+  index[c->count] = p->count;
+  instruction* end = &p->code[p->count];
+  end->offset = c->count;
+  end->op = OP_RETURN;
+  end->size = 0;
+  end->target = -1;
+  end->removed = false;
+
+  for (int i = 0; i < p->count; i++)
+  {
+    instruction* in = &p->code[i];
+    if (!is_jump(in->op)) { continue; }
+    // the jump offset is always the last operand and relative to the next instruction
+    int next = in->offset + in->size;
+    int jump = read_short(c, next - 2);
+    in->target = index[in->op == OP_LOOP ? next - jump : next + jump];
+  }
+  FREE_ARRAY(int, index, c->count+1);
+}
+
+static int next_live(program* p, int i)
+{
+  while (i < p->count && p->code[i].removed) { i++; }
+  return i;
+}
+
+static void remove_instruction(program* p, int i)
+{
+  p->code[i].removed = true;
+  if (p->code[i].is_target)
+  {
+    p->code[next_live(p, i+1)].is_target = true;
+  }
+}
+
+static void mark_targets(program* p)
+{
+  for (int i = 0; i <= p->count; i++) { p->code[i].is_target = false; }
+  for (int i = 0; i < p->count; i++)
+  {
+    instruction* in = &p->code[i];
+    if (in->removed || in->target == -1) { continue; }
+    in->target = next_live(p, in->target);
+    p->code[in->target].is_target = true;
+  }
+}
+
+// instructions only ever shrink or disappear, so a distance that fits in the
+// decoded byte offsets still fits once the chunk is encoded again
+static bool fits_jump(program* p, instruction* in, int target)
+{
+  return abs(p->code[target].offset - (in->offset + in->size)) <= UINT16_MAX;
+}
+
+// a jump landing on an unconditional jump can go straight to its target.
+// a conditional jump landing on another conditional jump knows the value
+// on the stack is still falsey, so it can skip that one as well
+static bool thread_jumps(program* p)
+{
+  bool changed = false;
+  for (int i = 0; i < p->count; i++)
+  {
+    instruction* in = &p->code[i];
+    if (in->removed || in->target == -1) { continue; }
+
+    for (int hops = 0; hops < p->count; hops++)
+    {
+      instruction* to = &p->code[in->target];
+      if (in->target == p->count || to->target == -1 || to->target == in->target) { break; }
+
+      bool follow = to->op == OP_JUMP || to->op == OP_LOOP
+        || (in->op == OP_JUMP_IF_FALSE && to->op == OP_JUMP_IF_FALSE);
+      // conditional jumps can only go forward
+      if (!follow || (is_conditional(in->op) && to->target <= i)) { break; }
+      if (!fits_jump(p, in, to->target)) { break; }
+
+      in->target = to->target;
+      changed = true;
+    }
+    // unconditional jumps may have changed direction
+    if (in->op == OP_JUMP || in->op == OP_LOOP)
+    {
+      in->op = in->target > i ? OP_JUMP : OP_LOOP;
+    }
+  }
+  return changed;
+}
+
+static bool remove_unreachable(program* p)
+{
+  bool* reachable = ALLOCATE(bool, p->count+1);
+  int* worklist = ALLOCATE(int, p->count+1);
+  for (int i = 0; i <= p->count; i++) { reachable[i] = false; }
+
+  int top = 0;
+  worklist[top++] = 0;
+  reachable[0] = true;
+  while (top > 0)
+  {
+    int i = worklist[--top];
+    if (i >= p->count) { continue; }
+    instruction* in = &p->code[i];
+    int successors[2] = { falls_through(in->op) ? i+1 : -1, in->target };
+    for (int s = 0; s < 2; s++)
+    {
+      int next = successors[s];
+      if (next == -1) { continue; }
+      next = next_live(p, next);
+      if (!reachable[next])
+      {
+        reachable[next] = true;
+        worklist[top++] = next;
+      }
+    }
+  }
+
+  bool changed = false;
+  for (int i = 0; i < p->count; i++)
+  {
+    if (!p->code[i].removed && !reachable[i])
+    {
+      p->code[i].removed = true;
+      changed = true;
+    }
+  }
+  FREE_ARRAY(bool, reachable, p->count+1);
+  FREE_ARRAY(int, worklist, p->count+1);
+  return changed;
+}
+
+static bool is_push(uint8_t op)
+{
+  return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE 
+    || op == OP_FALSE || op == OP_GET_LOCAL;
+}
+
+static bool same_operand(instruction* a, instruction* b)
+{
+  for (int i = 0; i < a->size-1; i++)
+  {
+    if (a->operands[i] != b->operands[i]) { return false; }
+  }
+  return true;
+}
+
+static bool remove_redundant(program* p)
+{
+  bool changed = false;
+  for (int i = next_live(p, 0); i < p->count; i = next_live(p, i+1))
+  {
+    instruction* a = &p->code[i];
+    int j = next_live(p, i+1);
+    if (j >= p->count) { break; }
+    instruction* b = &p->code[j];
+
+    // a jump to the very next instruction
+    if (a->op == OP_JUMP && next_live(p, a->target) == j)
+    {
+      remove_instruction(p, i);
+      changed = true;
+      continue;
+    }
+
+    if (b->is_target) { continue; }
+
+    // pushing a value just to pop it again
+    if (is_push(a->op) && b->op == OP_POP)
+    {
+      remove_instruction(p, i);
+      remove_instruction(p, j);
+      changed = true;
+      continue;
+    }
+
+    // a store whose value is popped and loaded right back, e.g. `x = 1; print x;`
+    int k = next_live(p, j+1);
+    if (k >= p->count || p->code[k].is_target) { continue; }
+    instruction* c = &p->code[k];
+    if (b->op == OP_POP && same_operand(a, c)
+      && ((a->op == OP_SET_LOCAL && c->op == OP_GET_LOCAL) 
+        || (a->op == OP_SET_GLOBAL && c->op == OP_GET_GLOBAL)))
+    {
+      remove_instruction(p, j);
+      remove_instruction(p, k);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// superinstructions for the opcode pairs that dominated the pair profile
+// of our benchmark scripts. runs once after everything else converged
+static void fuse(program* p)
+{
+  for (int i = next_live(p, 0); i < p->count; i = next_live(p, i+1))
+  {
+    instruction* a = &p->code[i];
+    int j = next_live(p, i+1);
+    if (j >= p->count) { break; }
+    instruction* b = &p->code[j];
+    if (b->is_target) { continue; }
+
+    uint8_t fused = a->op;
+    switch (a->op)
+    {
+      case OP_CONSTANT:
+        if (b->op == OP_ADD)            { fused = OP_ADD_CONSTANT; }
+        else if (b->op == OP_SUBTRACT)  { fused = OP_SUBTRACT_CONSTANT; }
+        else if (b->op == OP_LESS)      { fused = OP_LESS_CONSTANT; }
+      break; case OP_GET_LOCAL:
+        if (b->op == OP_GET_LOCAL) 
+        { 
+          fused = OP_GET_LOCALS; 
+          a->operands[1] = b->operands[0];
+          a->size = 3;
+        }
+      break; case OP_SET_LOCAL:
+        if (b->op == OP_POP) { fused = OP_SET_LOCAL_POP; }
+      break; case OP_SET_GLOBAL:
+        if (b->op == OP_POP) { fused = OP_SET_GLOBAL_POP; }
+      break; case OP_JUMP_IF_FALSE:
+      {
+        // both paths of a statement level condition start with OP_POP, the
+        // fused jump pops itself and lands behind the one on the false path
+        int target = next_live(p, a->target);
+        if (b->op == OP_POP && target < p->count && p->code[target].op == OP_POP)
+        {
+          fused = OP_POP_JUMP_IF_FALSE;
+          a->target = next_live(p, target+1);
+          p->code[a->target].is_target = true;
+        }
+      }
+      break; default: break;
+    }
+
+    if (fused != a->op)
+    {
+      a->op = fused;
+      remove_instruction(p, j);
+    }
+  }
+}
+
+static void encode(program* p)
+{
+  chunk* c = p->c;
+  int old_count = c->count;
+  uint8_t* code = ALLOCATE(uint8_t, old_count);
+  int* new_offset = ALLOCATE(int, p->count+1);
+
+  int offset = 0;
+  for (int i = 0; i < p->count; i++)
+  {
+    new_offset[i] = offset;
+    if (!p->code[i].removed) { offset += p->code[i].size; }
+  }
+  new_offset[p->count] = offset;
+
+  for (int i = 0; i < p->count; i++)
+  {
+    instruction* in = &p->code[i];
+    if (in->removed) { continue; }
+    int at = new_offset[i];
+    code[at] = in->op;
+    for (int b = 0; b < in->size; b++)
+    {
+      if (b > 0) { code[at+b] = in->operands[b-1]; }
+      c->lines[at+b] = in->line;
+    }
+    if (in->target != -1)
+    {
+      int next = at + in->size;
+      int target = new_offset[in->target];
+      int jump = in->op == OP_LOOP ? next - target : target - next;
+      if (jump < 0 || jump > UINT16_MAX)
+      {
+        // the compiler already rejected longer jumps, the rewrite made this one
+        fprintf(stderr, "Peephole pass produced a jump of %d bytes.\n", jump);
+        abort();
+      }
+      code[next-2] = (jump >> 8) & 0xff;
+      code[next-1] = jump & 0xff;
+    }
+  }
+
+  // lines[] was rewritten in place which is safe since instructions only
+  // ever move towards the start of the chunk
+  for (int i = 0; i < offset; i++) { c->code[i] = code[i]; }
+  c->count = offset;
+  FREE_ARRAY(uint8_t, code, old_count);
+  FREE_ARRAY(int, new_offset, p->count+1);
+}
+
+static int live_instructions(program* p)
+{
+  int live = 0;
+  for (int i = 0; i < p->count; i++)
+  {
+    if (!p->code[i].removed) { live++; }
+  }
+  return live;
+}
+
+peephole_stats optimize_chunk(chunk* c)
+{
+  peephole_stats stats = {0, 0};
+  if (c->count == 0) { return stats; }
+
+  program p;
+  p.c = c;
+  decode(&p);
+  stats.instructions_before = p.count;
+
+  bool changed = true;
+  while (changed)
+  {
+    mark_targets(&p);
+    changed = thread_jumps(&p);
+    changed |= remove_unreachable(&p);
+    mark_targets(&p);
+    changed |= remove_redundant(&p);
+  }
+
+  fuse(&p);
+  mark_targets(&p);
+  remove_unreachable(&p);
+
+  stats.instructions_after = live_instructions(&p);
+  int capacity = c->count+1;
+  encode(&p);
+  FREE_ARRAY(instruction, p.code, capacity);
+  return stats;
+}
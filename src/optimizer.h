@@ -0,0 +1,13 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+typedef struct {
+  int instructions_before;
+  int instructions_after;
+} peephole_stats;
+
+peephole_stats optimize_chunk(chunk* c);
+
+#endif 
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// asan only sees what libc hands out, debug builds stay on it by default
+#ifdef NDEBUG
+pool_allocator g_pool = { .enabled = true };
+#else
+pool_allocator g_pool = { .enabled = false };
+#endif
+
+static int size_class(size_t size)
+{
+  return (int)((size - 1) / POOL_GRANULE);
+}
+
+static size_t block_size(int index)
+{
+  return (size_t)(index + 1) * POOL_GRANULE;
+}
+
+// the rest of the previous slab is too small for a block and stays unused
+static void add_slab(pool_class* c)
+{
+  if (g_pool.slab_capacity < g_pool.slab_count + 1)
+  {
+    g_pool.slab_capacity = g_pool.slab_capacity < 8 ? 8 : g_pool.slab_capacity * 2;
+    g_pool.slabs = (void**)realloc(g_pool.slabs, sizeof(void*) * g_pool.slab_capacity);
+    if (g_pool.slabs == NULL) { exit(1); }
+  }
+  uint8_t* slab = (uint8_t*)malloc(POOL_SLAB_SIZE);
+  if (slab == NULL) { exit(1); }
+  g_pool.slabs[g_pool.slab_count++] = slab;
+  c->bump = slab;
+  c->bump_end = slab + POOL_SLAB_SIZE;
+  c->slabs++;
+}
+
+static void* pool_alloc(size_t size)
+{
+  int index = size_class(size);
+  pool_class* c = &g_pool.classes[index];
+  c->allocations++;
+
+  pool_block* block = c->free;
+  if (block != NULL)
+  {
+    c->free = block->next;
+    return block;
+  }
+  if (c->bump == NULL || c->bump + block_size(index) > c->bump_end)
+  {
+    add_slab(c);
+  }
+  void* result = c->bump;
+  c->bump += block_size(index);
+  return result;
+}
+
+static void pool_release(void* pointer, size_t size)
+{
+  pool_class* c = &g_pool.classes[size_class(size)];
+  c->frees++;
+  pool_block* block = (pool_block*)pointer;
+  block->next = c->free;
+  c->free = block;
+}
+
+static void* libc_alloc(size_t size)
+{
+  g_pool.libc_allocations++;
+  return malloc(size);
+}
+
+static void libc_free(void* pointer)
+{
+  g_pool.libc_frees++;
+  free(pointer);
+}
+
+void* pool_realloc(void* pointer, size_t old_size, size_t new_size)
+{
+  g_pool.requested_bytes += new_size - old_size;
+  if (!g_pool.enabled)
+  {
+    if (pointer == NULL) { return libc_alloc(new_size); }
+    g_pool.resizes++;
+    return realloc(pointer, new_size);
+  }
+
+  bool new_small = new_size <= POOL_MAX_SIZE;
+  if (pointer == NULL)
+  {
+    return new_small ? pool_alloc(new_size) : libc_alloc(new_size);
+  }
+  bool old_small = old_size <= POOL_MAX_SIZE;
+  if (old_small && new_small && size_class(old_size) == size_class(new_size))
+  {
+    return pointer;
+  }
+
+  g_pool.resizes++;
+  if (!old_small && !new_small) { return realloc(pointer, new_size); }
+  void* result = new_small ? pool_alloc(new_size) : libc_alloc(new_size);
+  if (result == NULL) { return NULL; }
+  memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+  if (old_small) { pool_release(pointer, old_size); }
+  else { libc_free(pointer); }
+  return result;
+}
+
+void pool_free(void* pointer, size_t size)
+{
+  if (pointer == NULL) { return; }
+  g_pool.requested_bytes -= size;
+  if (g_pool.enabled && size <= POOL_MAX_SIZE) { pool_release(pointer, size); }
+  else { libc_free(pointer); }
+}
+
+void free_pool()
+{
+  for (int i = 0; i < g_pool.slab_count; i++)
+  {
+    free(g_pool.slabs[i]);
+  }
+  free(g_pool.slabs);
+  g_pool.slabs = NULL;
+  g_pool.slab_count = 0;
+  g_pool.slab_capacity = 0;
+  memset(g_pool.classes, 0, sizeof(g_pool.classes));
+}
+
+// block_bytes against reserved_bytes is what the free lists and the slab
+// tails hold back, block_bytes against the requests is rounding
+void print_pool_stats(FILE* out)
+{
+  fprintf(out, "{\"allocator\": \"%s\", \"classes\": [", g_pool.enabled ? "pool" : "libc");
+  uint64_t block_bytes = 0;
+  const char* separator = "";
+  for (int i = 0; i < POOL_CLASSES; i++)
+  {
+    pool_class* c = &g_pool.classes[i];
+    if (c->allocations == 0) continue;
+    block_bytes += (c->allocations - c->frees) * block_size(i);
+    fprintf(out, "%s\n  {\"size\": %zu, \"allocations\": %llu, \"frees\": %llu, \"slabs\": %llu}",
+            separator, block_size(i), (unsigned long long)c->allocations,
+            (unsigned long long)c->frees, (unsigned long long)c->slabs);
+    separator = ",";
+  }
+  fprintf(out, "%s],\n \"libc_allocations\": %llu, \"libc_frees\": %llu, \"resizes\": %llu, "
+               "\"reserved_bytes\": %llu, \"block_bytes\": %llu, \"requested_bytes\": %zu}\n",
+          separator[0] == '\0' ? "" : "\n",
+          (unsigned long long)g_pool.libc_allocations, (unsigned long long)g_pool.libc_frees,
+          (unsigned long long)g_pool.resizes,
+          (unsigned long long)g_pool.slab_count * POOL_SLAB_SIZE,
+          (unsigned long long)block_bytes, g_pool.requested_bytes);
+}
@@ -0,0 +1,51 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// requests up to POOL_MAX_SIZE bytes are served from size classes
+// POOL_GRANULE bytes apart. every class carves its blocks out of
+// POOL_SLAB_SIZE slabs and keeps the freed ones on a free list, anything
+// larger goes to libc
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct pool_block {
+  struct pool_block* next;
+} pool_block;
+
+typedef struct {
+  pool_block* free;
+  uint8_t* bump;      // unused rest of the newest slab
+  uint8_t* bump_end;
+  uint64_t allocations;
+  uint64_t frees;
+  uint64_t slabs;
+} pool_class;
+
+typedef struct {
+  bool enabled;       // false sends everything to libc
+  pool_class classes[POOL_CLASSES];
+  void** slabs;
+  int slab_count;
+  int slab_capacity;
+  uint64_t libc_allocations;  // large blocks, or everything when disabled
+  uint64_t libc_frees;
+  uint64_t resizes;       // reallocations that had to move or grow
+  size_t requested_bytes; // what is live as the callers see it
+} pool_allocator;
+
+extern pool_allocator g_pool;
+
+// reallocate() hands every allocation to these, the callers always know
+// the old size so blocks don't need a header
+void* pool_realloc(void* pointer, size_t old_size, size_t new_size);
+void pool_free(void* pointer, size_t size);
+void free_pool();
+void print_pool_stats(FILE* out);
+
+#endif
@@ -0,0 +1,157 @@
+#include "profiler.h"
+
+#ifdef PROFILER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "vm.h"
+
+// one distinct lox stack and how often it was seen. the profiler keeps its
+// bookkeeping on malloc so it never shows up in the vm's own heap numbers
+typedef struct {
+  char* stack;
+  int length;
+  uint32_t hash;
+  uint64_t count;
+} sample;
+
+typedef struct {
+  sample* samples;
+  int count;
+  int capacity;
+  const char* path;
+} profiler;
+
+volatile sig_atomic_t g_sample_pending = 0;
+static profiler g_profiler;
+
+static void on_sigprof(int signal)
+{
+  (void)signal;
+  g_sample_pending = 1;
+}
+
+bool start_profiler(const char* path)
+{
+  g_profiler.path = path;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_sigprof;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / PROFILER_HZ;
+  timer.it_value = timer.it_interval;
+  return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+static uint32_t hash_stack(const char* stack, int length)
+{
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++)
+  {
+    hash ^= (uint8_t)stack[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static sample* find_sample(sample* samples, int capacity, const char* stack, int length, uint32_t hash)
+{
+  uint32_t index = hash & (capacity - 1);
+  for (;;)
+  {
+    sample* s = &samples[index];
+    if (s->stack == NULL) return s;
+    if (s->hash == hash && s->length == length && memcmp(s->stack, stack, length) == 0) return s;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void grow_samples()
+{
+  int capacity = g_profiler.capacity < 64 ? 64 : g_profiler.capacity * 2;
+  sample* samples = calloc(capacity, sizeof(sample));
+  if (samples == NULL) exit(1);
+  for (int i = 0; i < g_profiler.capacity; i++)
+  {
+    sample* old = &g_profiler.samples[i];
+    if (old->stack == NULL) continue;
+    *find_sample(samples, capacity, old->stack, old->length, old->hash) = *old;
+  }
+  free(g_profiler.samples);
+  g_profiler.samples = samples;
+  g_profiler.capacity = capacity;
+}
+
+// folds the current frames into "script:12;fib:4;fib:5", outermost first
+void take_sample()
+{
+  g_sample_pending = 0;
+
+  char stack[FRAMES_MAX * 64];
+  int length = 0;
+  for (int i = 0; i < g_vm.frame_count; i++)
+  {
+    call_frame* frame = &g_vm.frames[i];
+    obj_function* func = frame->function;
+    int offset = (int)(frame->ip - func->chunk.code) - 1;
+    int line = func->chunk.lines[offset < 0 ? 0 : offset];
+    length += snprintf(stack + length, sizeof(stack) - length, "%s%s:%d",
+                       i == 0 ? "" : ";",
+                       func->name == NULL ? "script" : func->name->chars, line);
+    if (length >= (int)sizeof(stack)) length = sizeof(stack) - 1;
+  }
+  if (length == 0) return;
+
+  if (g_profiler.count + 1 > g_profiler.capacity * 3 / 4) grow_samples();
+  uint32_t hash = hash_stack(stack, length);
+  sample* s = find_sample(g_profiler.samples, g_profiler.capacity, stack, length, hash);
+  if (s->stack == NULL)
+  {
+    s->stack = malloc(length + 1);
+    if (s->stack == NULL) exit(1);
+    memcpy(s->stack, stack, length + 1);
+    s->length = length;
+    s->hash = hash;
+    g_profiler.count++;
+  }
+  s->count++;
+}
+
+// stops the timer and writes every stack with its count, one per line, the
+// folded format flamegraph.pl and friends read
+void stop_profiler()
+{
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+
+  FILE* out = fopen(g_profiler.path, "w");
+  if (out == NULL)
+  {
+    fprintf(stderr, "Could not write profile \"%s\".\n", g_profiler.path);
+  }
+  for (int i = 0; i < g_profiler.capacity; i++)
+  {
+    sample* s = &g_profiler.samples[i];
+    if (s->stack == NULL) continue;
+    if (out != NULL) fprintf(out, "%s %llu\n", s->stack, (unsigned long long)s->count);
+    free(s->stack);
+  }
+  if (out != NULL) fclose(out);
+  free(g_profiler.samples);
+  g_profiler.samples = NULL;
+  g_profiler.count = 0;
+  g_profiler.capacity = 0;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <signal.h>
+
+#include "common.h"
+
+#ifdef PROFILER
+
+// samples per second of cpu time
+#define PROFILER_HZ 1000
+
+// set from the SIGPROF handler, run() takes the sample at the next call or
+// loop back-edge where the frames are consistent
+extern volatile sig_atomic_t g_sample_pending;
+
+bool start_profiler(const char* path);
+void take_sample();
+void stop_profiler();
+
+#endif
+
+#endif
@@ -1,39 +1,167 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "scanner.h"
 
 typedef struct {
   const char* start;
   const char* current;
+  const char* end;  // the terminating '\0', the block scans stop 16 bytes before
   int line;
 } scanner_t;
 
 scanner_t scanner; 
 
+#define CLASS_ALPHA 1
+#define CLASS_DIGIT 2
+
+static uint8_t char_class[256];
+
+static void init_char_classes()
+{
+  for (int c = 'a'; c <= 'z'; c++) char_class[c] = CLASS_ALPHA;
+  for (int c = 'A'; c <= 'Z'; c++) char_class[c] = CLASS_ALPHA;
+  char_class['_'] = CLASS_ALPHA;
+  for (int c = '0'; c <= '9'; c++) char_class[c] = CLASS_DIGIT;
+}
+
 void init_scanner(const char* source)
 {
+  if (char_class['a'] == 0) { init_char_classes(); }
   scanner.start = source;
   scanner.current = source; 
+  scanner.end = source + strlen(source);
   scanner.line = 1; 
 }
 
 static bool is_alpha(char c)
 {
-  return  (c >= 'a' && c <= 'z') ||
-          (c >= 'A' && c <= 'Z') ||
-          c == '_';
+  return char_class[(uint8_t)c] & CLASS_ALPHA;
 }
 
 static bool is_digit(char c)
 {
-  return c >= '0' && c <= '9';
+  return char_class[(uint8_t)c] & CLASS_DIGIT;
+}
+
+#ifdef __SSE2__
+
+#define BLOCK 16
+
+static inline int first_bit(uint32_t mask)
+{
+  return __builtin_ctz(mask);
+}
+
+static inline int count_bits(uint32_t mask)
+{
+  return __builtin_popcount(mask);
+}
+
+static inline __m128i load_block(const char* p)
+{
+  return _mm_loadu_si128((const __m128i*)p);
+}
+
+static inline uint32_t byte_mask(__m128i block, char c)
+{
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// bytes from lo to hi, compared unsigned
+static inline __m128i in_range(__m128i block, char lo, char hi)
+{
+  __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(block, _mm_set1_epi8(lo)), block);
+  __m128i below = _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(hi)), block);
+  return _mm_and_si128(above, below);
+}
+
+#endif
+
+// the skip_* helpers move scanner.current over a run of one kind of
+// character a block at a time and leave the rest of the run to the
+// scalar loops of their callers
+
+// spaces, tabs, carriage returns and newlines
+static void skip_blank_run()
+{
+#ifdef __SSE2__
+  while (scanner.current + BLOCK <= scanner.end)
+  {
+    __m128i block = load_block(scanner.current);
+    uint32_t newlines = byte_mask(block, '\n');
+    uint32_t blank = newlines | byte_mask(block, ' ') | byte_mask(block, '\t')
+                   | byte_mask(block, '\r');
+    if (blank != 0xffff)
+    {
+      int length = first_bit(~blank);
+      scanner.line += count_bits(newlines & ((1u << length) - 1));
+      scanner.current += length;
+      return;
+    }
+    scanner.line += count_bits(newlines);
+    scanner.current += BLOCK;
+  }
+#endif
+}
+
+// up to the newline that ends a comment
+static void skip_comment_body()
+{
+  const char* newline = memchr(scanner.current, '\n', scanner.end - scanner.current);
+  scanner.current = newline != NULL ? newline : scanner.end;
+}
+
+// up to the closing quote, counting the newlines on the way
+static void skip_string_body()
+{
+#ifdef __SSE2__
+  while (scanner.current + BLOCK <= scanner.end)
+  {
+    __m128i block = load_block(scanner.current);
+    uint32_t newlines = byte_mask(block, '\n');
+    uint32_t quotes = byte_mask(block, '"');
+    if (quotes != 0)
+    {
+      int length = first_bit(quotes);
+      scanner.line += count_bits(newlines & ((1u << length) - 1));
+      scanner.current += length;
+      return;
+    }
+    scanner.line += count_bits(newlines);
+    scanner.current += BLOCK;
+  }
+#endif
+}
+
+// letters, digits and underscores
+static void skip_identifier_body()
+{
+#ifdef __SSE2__
+  while (scanner.current + BLOCK <= scanner.end)
+  {
+    __m128i block = load_block(scanner.current);
+    __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+    __m128i word = _mm_or_si128(in_range(lower, 'a', 'z'), in_range(block, '0', '9'));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(word) | byte_mask(block, '_');
+    if (mask != 0xffff)
+    {
+      scanner.current += first_bit(~mask);
+      return;
+    }
+    scanner.current += BLOCK;
+  }
+#endif
 }
 
 static bool is_at_end()
 {
-  return *scanner.current == '\0';
+  return scanner.current == scanner.end;
 }
 
 static char advance() 
@@ -87,18 +215,18 @@ static void skip_whitespace()
       case ' ':
       case '\r':
       case '\t':
-        advance(); break;
+        advance(); 
+        break;
       case '\n':
         scanner.line++;
         advance();
+        skip_blank_run();
         break;
       case '/':
         if (peek_next() == '/')
         {
-          while (peek() != '\n' && !is_at_end()) 
-          { 
-            advance(); 
-          }
+          skip_comment_body();
+          break;
         } 
         else 
         {
@@ -110,61 +238,66 @@ static void skip_whitespace()
   }
 }
 
-static token_type check_keyword(int start, int length, const char* rest, token_type type)
-{
-  if (  scanner.current - scanner.start == start + length && 
-        memcmp(scanner.start + start, rest, length) == 0 )
-  {
-    return  type;
-  } 
-  else 
-  {
-    return TOKEN_IDENTIFIER;
-  }
-}
+typedef struct {
+  const char* name;
+  int length;
+  token_type type;
+} keyword;
+
+// a perfect hash over the keywords: the first two characters and the
+// length pick the only keyword that can match. the multipliers are the
+// smallest that keep all sixteen apart in 32 slots, the check below
+// fails the build when a new keyword collides
+#define KEYWORD_SLOT(c0, c1, length) \
+  ((((uint8_t)(c0) * 3 + (uint8_t)(c1) * 7 + (length)) >> 2) & 31)
+
+#define KEYWORDS(K) \
+  K('a', 'n', "and",    TOKEN_AND) \
+  K('c', 'l', "class",  TOKEN_CLASS) \
+  K('e', 'l', "else",   TOKEN_ELSE) \
+  K('f', 'a', "false",  TOKEN_FALSE) \
+  K('f', 'o', "for",    TOKEN_FOR) \
+  K('f', 'u', "fun",    TOKEN_FUN) \
+  K('i', 'f', "if",     TOKEN_IF) \
+  K('n', 'i', "nil",    TOKEN_NIL) \
+  K('o', 'r', "or",     TOKEN_OR) \
+  K('p', 'r', "print",  TOKEN_PRINT) \
+  K('r', 'e', "return", TOKEN_RETURN) \
+  K('s', 'u', "super",  TOKEN_SUPER) \
+  K('t', 'h', "this",   TOKEN_THIS) \
+  K('t', 'r', "true",   TOKEN_TRUE) \
+  K('v', 'a', "var",    TOKEN_VAR) \
+  K('w', 'h', "while",  TOKEN_WHILE)
+
+#define KEYWORD_BIT(c0, c1, name) \
+  ((uint64_t)1 << KEYWORD_SLOT(c0, c1, sizeof(name) - 1))
+#define KEYWORD_SUM(c0, c1, name, type) + KEYWORD_BIT(c0, c1, name)
+#define KEYWORD_OR(c0, c1, name, type)  | KEYWORD_BIT(c0, c1, name)
+#define KEYWORD_ENTRY(c0, c1, name, type) \
+  [KEYWORD_SLOT(c0, c1, sizeof(name) - 1)] = { name, sizeof(name) - 1, type },
+
+// adding the slot bits only matches or-ing them when no two are the same
+_Static_assert((0 KEYWORDS(KEYWORD_SUM)) == (0 KEYWORDS(KEYWORD_OR)),
+               "two keywords share a slot, KEYWORD_SLOT needs new multipliers");
+
+static const keyword keywords[32] = { KEYWORDS(KEYWORD_ENTRY) };
 
 static token_type identifier_type()
 {
-  switch (scanner.start[0])
+  int length = (int)(scanner.current - scanner.start);
+  if (length < 2 || length > 6) { return TOKEN_IDENTIFIER; }
+  const keyword* k = &keywords[KEYWORD_SLOT(scanner.start[0], scanner.start[1], length)];
+  if (k->length == length && memcmp(k->name, scanner.start, length) == 0)
   {
-    case 'a': return check_keyword(1,2, "nd", TOKEN_AND);
-    case 'c': return check_keyword(1,4, "lass", TOKEN_CLASS);
-    case 'e': return check_keyword(1,3, "lse", TOKEN_ELSE);
-    case 'f' : 
-      if (scanner.current - scanner.start > 1) 
-      {
-        switch (scanner.start[1])
-        {
-        case 'a': return check_keyword(2,3, "lse", TOKEN_FALSE);
-        case 'o': return check_keyword(2,1, "r", TOKEN_FOR);
-        case 'u': return check_keyword(2,1, "n", TOKEN_FUN);
-        }
-      }
-    case 'i': return check_keyword(1,1, "f", TOKEN_IF);
-    case 'n': return check_keyword(1,2, "il", TOKEN_NIL);
-    case 'o': return check_keyword(1,1, "or", TOKEN_OR);
-    case 'p': return check_keyword(1,4, "rint", TOKEN_PRINT);
-    case 'r': return check_keyword(1,5, "eturn", TOKEN_RETURN);
-    case 's': return check_keyword(1,4, "uper", TOKEN_SUPER);
-    case 't' : 
-      if (scanner.current - scanner.start > 1) 
-      {
-        switch (scanner.start[1])
-        {
-        case 'h': return check_keyword(2,2, "is", TOKEN_THIS);
-        case 'r': return check_keyword(2,2, "ue", TOKEN_TRUE);
-        }
-      }
-    case 'v': return check_keyword(1,2, "ar", TOKEN_VAR);
-    case 'w': return check_keyword(1,4, "hile", TOKEN_WHILE);
+    return k->type;
   }
-
   return TOKEN_IDENTIFIER;
 }
 
 static token identifier()
 {
-  while (is_alpha(peek()) || is_digit(peek())) 
+  skip_identifier_body();
+  while (char_class[(uint8_t)peek()] & (CLASS_ALPHA | CLASS_DIGIT)) 
   {
     advance();
   }
@@ -184,6 +317,7 @@ static token number()
 
 static token string()
 {
+  skip_string_body();
   while (peek() != '"' && !is_at_end())
   {
     if (peek() == '\n')
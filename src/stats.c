@@ -0,0 +1,101 @@
+#include "stats.h"
+
+#ifdef VM_STATS
+
+#include "debug.h"
+#include "vm.h"
+
+#define PROBE_BUCKETS 16
+
+vm_stats g_stats = { .previous = -1 };
+
+static void print_probes(FILE* out, const char* name, probe_stats* stats)
+{
+  fprintf(out, "  \"%s\": {\"count\": %llu, \"probes\": %llu, \"max_probe\": %llu},\n",
+          name, (unsigned long long)stats->count,
+          (unsigned long long)stats->probes, (unsigned long long)stats->max_probe);
+}
+
+// index i of probe_lengths counts the keys found after i + 1 groups, the
+// last one everything further out
+static void print_table(FILE* out, const char* name, table* t)
+{
+  uint64_t counts[PROBE_BUCKETS] = {0};
+  table_probe_lengths(t, counts, PROBE_BUCKETS);
+  fprintf(out, "  \"%s\": {\"count\": %d, \"tombstones\": %d, \"capacity\": %d, "
+               "\"max_probe\": %d, \"probe_lengths\": [",
+          name, t->count, t->tombstones, t->capacity, t->max_probe);
+  for (int i = 0; i < PROBE_BUCKETS; i++)
+  {
+    fprintf(out, "%s%llu", i == 0 ? "" : ", ", (unsigned long long)counts[i]);
+  }
+  fprintf(out, "]},\n");
+}
+
+// one json object, only opcodes and pairs that actually ran are listed
+void print_stats(FILE* out)
+{
+  fprintf(out, "{\n  \"opcodes\": {");
+  const char* separator = "";
+  for (int op = 0; op < OPCODE_COUNT; op++)
+  {
+    if (g_stats.opcodes[op] == 0) continue;
+    fprintf(out, "%s\n    \"%s\": %llu", separator, opcode_name(op),
+            (unsigned long long)g_stats.opcodes[op]);
+    separator = ",";
+  }
+
+  fprintf(out, "\n  },\n  \"pairs\": {");
+  separator = "";
+  for (int first = 0; first < OPCODE_COUNT; first++)
+  {
+    for (int second = 0; second < OPCODE_COUNT; second++)
+    {
+      uint64_t count = g_stats.pairs[first][second];
+      if (count == 0) continue;
+      fprintf(out, "%s\n    \"%s %s\": %llu", separator, opcode_name(first),
+              opcode_name(second), (unsigned long long)count);
+      separator = ",";
+    }
+  }
+
+  fprintf(out, "\n  },\n  \"functions\": [");
+  separator = "";
+  // a collection may still be sweeping part of the heap
+  obj* lists[] = { g_vm.objects, g_vm.sweeping };
+  for (int i = 0; i < 2; i++)
+  {
+    for (obj* object = lists[i]; object != NULL; object = object->next)
+    {
+      if (object->type != OBJ_FUNCTION) continue;
+      obj_function* func = (obj_function*)object;
+      fprintf(out, "%s\n    {\"name\": \"%s\", \"calls\": %llu, \"instructions\": %llu}",
+              separator, func->name == NULL ? "script" : func->name->chars,
+              (unsigned long long)func->calls, (unsigned long long)func->instructions);
+      separator = ",";
+    }
+  }
+
+  fprintf(out, "\n  ],\n");
+  print_probes(out, "table_lookups", &g_stats.lookups);
+  print_probes(out, "string_interning", &g_stats.interning);
+  print_table(out, "string_table", &g_vm.strings);
+  print_table(out, "global_table", &g_vm.global_slots);
+  fprintf(out, "  \"table_resizes\": {\"grows\": %llu, \"shrinks\": %llu, \"rehashes\": %llu},\n",
+          (unsigned long long)g_stats.table_grows, (unsigned long long)g_stats.table_shrinks,
+          (unsigned long long)g_stats.table_rehashes);
+  fprintf(out, "  \"memory\": {\"allocations\": %llu, \"bytes_allocated\": %llu, \"bytes_freed\": %llu},\n",
+          (unsigned long long)g_stats.allocations,
+          (unsigned long long)g_stats.bytes_allocated,
+          (unsigned long long)g_stats.bytes_freed);
+  fprintf(out, "  \"gc\": {\"collections\": %llu, \"minor_collections\": %llu, \"young_bytes\": %llu, "
+               "\"promoted_bytes\": %llu, \"minor_ns\": %llu, \"max_minor_ns\": %llu}\n}\n",
+          (unsigned long long)g_stats.collections,
+          (unsigned long long)g_stats.minor_collections,
+          (unsigned long long)g_stats.young_bytes,
+          (unsigned long long)g_stats.promoted_bytes,
+          (unsigned long long)g_stats.minor_ns,
+          (unsigned long long)g_stats.max_minor_ns);
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef clox_stats_h
+#define clox_stats_h
+
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+
+static inline uint64_t clock_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+#ifdef VM_STATS
+
+typedef struct {
+  uint64_t count;
+  uint64_t probes;    // groups of slots looked at, 1 means a direct hit
+  uint64_t max_probe;
+} probe_stats;
+
+typedef struct {
+  uint64_t opcodes[OPCODE_COUNT];
+  uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+  int previous;           // opcode executed last, -1 before the first one
+  probe_stats lookups;    // table get/set/delete, globals resolve through these
+  probe_stats interning;  // table_find_string
+  uint64_t table_grows;
+  uint64_t table_shrinks;
+  uint64_t table_rehashes;  // in place, to drop tombstones
+  uint64_t allocations;
+  uint64_t bytes_allocated;
+  uint64_t bytes_freed;
+  uint64_t collections;
+  uint64_t minor_collections;
+  uint64_t young_bytes;     // bump allocated in the nursery
+  uint64_t promoted_bytes;  // copied out of it by minor collections
+  uint64_t minor_ns;
+  uint64_t max_minor_ns;
+} vm_stats;
+
+extern vm_stats g_stats;
+
+static inline void count_instruction(obj_function* func, uint8_t op)
+{
+  g_stats.opcodes[op]++;
+  if (g_stats.previous >= 0) g_stats.pairs[g_stats.previous][op]++;
+  g_stats.previous = op;
+  func->instructions++;
+}
+
+static inline void count_probes(probe_stats* stats, uint64_t probes)
+{
+  stats->count++;
+  stats->probes += probes;
+  if (probes > stats->max_probe) stats->max_probe = probes;
+}
+
+void print_stats(FILE* out);
+
+#endif
+
+#endif
@@ -1,87 +1,258 @@
-
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
+#include "stats.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// keys and tombstones together fill at most 7/8 of the slots
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+#define GROW_TABLE(capacity) \
+  ((capacity) < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : (capacity) * 2)
+
+// past an eighth of tombstones the table is rehashed where it is, below
+// an eighth of live keys it shrinks. a shrunk table starts at most 7/16
+// full so it doesn't have to grow again right away
+#define TABLE_MAX_TOMBSTONES(capacity) ((capacity) / 8)
+#define TABLE_MIN_LOAD(capacity) ((capacity) / 8)
+
+// the entries and the control bytes share one allocation
+static size_t table_bytes(int capacity)
+{
+  return (size_t)capacity * (sizeof(entry) + 1);
+}
+
+// the low 7 bits of the hash go to the control byte, the rest picks the
+// group a key starts probing from
+static inline uint8_t hash_fragment(uint32_t hash)
+{
+  return (uint8_t)(hash & 0x7f);
+}
+
+static inline int home_group(uint32_t hash, int groups)
+{
+  return (int)((hash >> 7) & (uint32_t)(groups - 1));
+}
+
+// groups are visited in triangular steps, with a power of two of them
+// that reaches every group once
+static inline int next_group(int group, int probe, int groups)
+{
+  return (group + probe + 1) & (groups - 1);
+}
+
+// bit i is set when control byte i of the group equals `byte`
+static inline uint32_t group_match(const uint8_t* group, uint8_t byte)
+{
+#ifdef __SSE2__
+  __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) mask |= (uint32_t)(group[i] == byte) << i;
+  return mask;
+#endif
+}
+
+// empty and deleted slots, the markers are the bytes with the high bit set
+static inline uint32_t group_free(const uint8_t* group)
+{
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) mask |= (uint32_t)(group[i] >> 7) << i;
+  return mask;
+#endif
+}
+
+static inline int lowest_bit(uint32_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while ((mask & 1) == 0) { mask >>= 1; bit++; }
+  return bit;
+#endif
+}
 
 void init_table(table* t)
 {
   t->count = 0;
+  t->tombstones = 0;
   t->capacity = 0;
+  t->max_probe = 0;
+  t->generation = 0;
   t->entries = NULL;
+  t->control = NULL;
 }
 
 void free_table(table* t)
 {
-  FREE_ARRAY(entry, t->entries, t->capacity);
+  if (t->capacity > 0) { reallocate(t->entries, table_bytes(t->capacity), 0); }
   init_table(t);
 }
 
-static entry* find_entry(entry* entries, int capacity, obj_string* key)
+// the slot of `key` or -1. no key sits more than max_probe groups from
+// its home, so a miss stops there even when tombstones filled every
+// group on the way
+static int find_slot(table* t, obj_string* key)
 {
-  uint32_t index = key->hash % capacity;
-  entry* tombstone = NULL;
-  for(;;)
+  int groups = t->capacity / TABLE_GROUP_WIDTH;
+  int group = home_group(key->hash, groups);
+  uint8_t fragment = hash_fragment(key->hash);
+  for (int probe = 0; probe < t->max_probe; probe++)
   {
-    entry* e = &entries[index];
-
-    if (e->key == NULL) 
+    const uint8_t* control = t->control + group * TABLE_GROUP_WIDTH;
+    for (uint32_t match = group_match(control, fragment); match != 0; match &= match - 1)
     {
-      if (IS_NIL(e->value))
+      int index = group * TABLE_GROUP_WIDTH + lowest_bit(match);
+      if (t->entries[index].key == key)
       {
-        return tombstone != NULL ? tombstone : e;
-      } 
-      else 
-      {
-        if (tombstone == NULL) {tombstone = e; }
+#ifdef VM_STATS
+        count_probes(&g_stats.lookups, probe + 1);
+#endif
+        return index;
       }
     }
-    else if (e->key == key)
+    if (group_match(control, CONTROL_EMPTY) != 0)
     {
-      return e;
+#ifdef VM_STATS
+      count_probes(&g_stats.lookups, probe + 1);
+#endif
+      return -1;
     }
+    group = next_group(group, probe, groups);
+  }
+#ifdef VM_STATS
+  count_probes(&g_stats.lookups, t->max_probe);
+#endif
+  return -1;
+}
 
-    index = (index+1) % capacity;
+// the first empty or deleted slot on the probe sequence of `hash`, the
+// load factor guarantees there is one
+static int free_slot(table* t, uint32_t hash, int* probes)
+{
+  int groups = t->capacity / TABLE_GROUP_WIDTH;
+  int group = home_group(hash, groups);
+  for (int probe = 0;; probe++)
+  {
+    uint32_t available = group_free(t->control + group * TABLE_GROUP_WIDTH);
+    if (available != 0)
+    {
+      *probes = probe + 1;
+      return group * TABLE_GROUP_WIDTH + lowest_bit(available);
+    }
+    group = next_group(group, probe, groups);
   }
 }
 
+static void place(table* t, int index, int probes, obj_string* key, value v)
+{
+  t->control[index] = hash_fragment(key->hash);
+  t->entries[index].key = key;
+  t->entries[index].value = v;
+  if (probes > t->max_probe) { t->max_probe = probes; }
+}
+
+// rehashing drops the tombstones
 static void adjust_capacity(table* t, int capacity)
 {
-  entry* entries = ALLOCATE(entry, capacity);
-  for (int i = 0 ; i < capacity ; i++)
+  uint8_t* block = ALLOCATE(uint8_t, table_bytes(capacity));
+#ifdef VM_STATS
+  if (capacity > t->capacity) g_stats.table_grows++;
+  else g_stats.table_shrinks++;
+#endif
+  table old = *t;
+  t->generation++;
+  t->entries = (entry*)block;
+  t->control = block + sizeof(entry) * capacity;
+  t->capacity = capacity;
+  t->tombstones = 0;
+  t->max_probe = 0;
+  memset(t->control, CONTROL_EMPTY, capacity);
+  for (int i = 0; i < capacity; i++)
   {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+    t->entries[i].key = NULL;
+    t->entries[i].value = NIL_VAL;
   }
-  t->count = 0;
+  for (int i = 0; i < old.capacity; i++)
+  {
+    if (old.control[i] & 0x80) { continue; }
+    int probes;
+    int index = free_slot(t, old.entries[i].key->hash, &probes);
+    place(t, index, probes, old.entries[i].key, old.entries[i].value);
+  }
+  if (old.capacity > 0) { reallocate(old.entries, table_bytes(old.capacity), 0); }
+}
+
+// drops the tombstones without a new allocation. every key is taken out
+// and put back on its probe sequence: keys whose first free group is
+// their own stay, the others move to an empty slot or swap with a key
+// that is still waiting for its turn
+static void rehash_in_place(table* t)
+{
+#ifdef VM_STATS
+  g_stats.table_rehashes++;
+#endif
+  t->generation++;
+  t->tombstones = 0;
+  t->max_probe = 0;
   for (int i = 0; i < t->capacity; i++)
   {
-    entry* e = &t->entries[i];
-    if (e->key == NULL) { continue; }
-    entry* dst = find_entry(entries, capacity, e->key);
-    dst->key = e->key;
-    dst->value = e->value;
-    t->count++;
+    t->control[i] = t->control[i] & 0x80 ? CONTROL_EMPTY : CONTROL_DELETED;
   }
-  FREE_ARRAY(entry, t->entries, t->capacity);
-  t->entries = entries;
-  t->capacity = capacity;
+  for (int i = 0; i < t->capacity; i++)
+  {
+    while (t->control[i] == CONTROL_DELETED)
+    {
+      int probes;
+      int index = free_slot(t, t->entries[i].key->hash, &probes);
+      if (index / TABLE_GROUP_WIDTH == i / TABLE_GROUP_WIDTH)
+      {
+        place(t, i, probes, t->entries[i].key, t->entries[i].value);
+      }
+      else if (t->control[index] == CONTROL_EMPTY)
+      {
+        place(t, index, probes, t->entries[i].key, t->entries[i].value);
+        t->control[i] = CONTROL_EMPTY;
+        t->entries[i].key = NULL;
+        t->entries[i].value = NIL_VAL;
+      }
+      else
+      {
+        entry waiting = t->entries[index];
+        place(t, index, probes, t->entries[i].key, t->entries[i].value);
+        t->control[i] = CONTROL_DELETED;
+        t->entries[i] = waiting;
+      }
+    }
+  }
+}
+
+// the smallest capacity that holds `count` keys at most 7/16 full
+static int fitting_capacity(int count)
+{
+  int capacity = TABLE_GROUP_WIDTH;
+  while (count > TABLE_MAX_LOAD(capacity) / 2) { capacity *= 2; }
+  return capacity;
 }
 
 void table_add_all(table* from, table* to)
 {
   for (int i = 0; i < from->capacity ; i++)
   {
-    entry* e = &from->entries[i];
-    if (e->key != NULL)
-    {
-      table_set(to, e->key, e->value);
-    }
+    if (from->control[i] & 0x80) { continue; }
+    table_set(to, from->entries[i].key, from->entries[i].value);
   }
 }
 
@@ -89,62 +260,159 @@ obj_string* table_find_string(table* t, const char* chars, int length, uint32_t
 {
   if (t->count == 0) { return NULL; }
 
-  uint32_t index = hash % t->capacity;
-  for(;;)
+  int groups = t->capacity / TABLE_GROUP_WIDTH;
+  int group = home_group(hash, groups);
+  uint8_t fragment = hash_fragment(hash);
+  for (int probe = 0; probe < t->max_probe; probe++)
   {
-    entry* e = &t->entries[index];
-    if (e->key == NULL) 
+    const uint8_t* control = t->control + group * TABLE_GROUP_WIDTH;
+    for (uint32_t match = group_match(control, fragment); match != 0; match &= match - 1)
     {
-      if (IS_NIL(e->value)) { return NULL; }
+      obj_string* key = t->entries[group * TABLE_GROUP_WIDTH + lowest_bit(match)].key;
+      if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0)
+      {
+#ifdef VM_STATS
+        count_probes(&g_stats.interning, probe + 1);
+#endif
+        return key;
+      }
     }
-    else if (e->key->length == length 
-      && e->key->hash == hash 
-      && memcmp(e->key->chars, chars, length) == 0)
+    if (group_match(control, CONTROL_EMPTY) != 0)
     {
-      return e->key;
+#ifdef VM_STATS
+      count_probes(&g_stats.interning, probe + 1);
+#endif
+      return NULL;
     }
-
-    index = (index+1) % t->capacity;
+    group = next_group(group, probe, groups);
   }
+#ifdef VM_STATS
+  count_probes(&g_stats.interning, t->max_probe);
+#endif
+  return NULL;
 }
 
 bool table_get(table* t, obj_string* key, value* v)
 {
   if (t->count == 0) { return false; }
-  
-  entry* e = find_entry(t->entries, t->capacity, key);
-  if (e->key == NULL) { return false; }
-  
-  *v = e->value; 
-  return v;
+
+  int index = find_slot(t, key);
+  if (index < 0) { return false; }
+
+  *v = t->entries[index].value;
+  return true;
 }
 
+// a group that still has an empty slot was never full, so no lookup ever
+// went past it and the slot can go back to empty. only slots of groups
+// that filled up become tombstones
 bool table_delete(table* t, obj_string* key)
 {
   if (t->count == 0) { return false; }
 
-  entry* e = find_entry(t->entries, t->capacity, key);
-  if (e->key == NULL) { return false; }
+  int index = find_slot(t, key);
+  if (index < 0) { return false; }
+
+  const uint8_t* group = t->control + (index & ~(TABLE_GROUP_WIDTH - 1));
+  if (group_match(group, CONTROL_EMPTY) != 0)
+  {
+    t->control[index] = CONTROL_EMPTY;
+  }
+  else
+  {
+    t->control[index] = CONTROL_DELETED;
+    t->tombstones++;
+  }
+  t->entries[index].key = NULL;
+  t->entries[index].value = NIL_VAL;
+  t->count--;
+  return true;
+}
+
+// points the entry of `key` at `moved`, a copy with the same hash. used
+// when the collector moves a key out of the nursery
+void table_replace_key(table* t, obj_string* key, obj_string* moved)
+{
+  if (t->count == 0) { return; }
+
+  int index = find_slot(t, key);
+  if (index >= 0) { t->entries[index].key = moved; }
+}
+
+// the capacity the table moves to before a new key goes in, its own when
+// it stays in place. deletes come from the collector, which can't
+// allocate, so the table is tidied up on the next insert instead
+static int insert_capacity(table* t)
+{
+  if (t->count < TABLE_MIN_LOAD(t->capacity) && t->capacity > TABLE_GROUP_WIDTH)
+  {
+    return fitting_capacity(t->count + 1);
+  }
+  if (t->tombstones > TABLE_MAX_TOMBSTONES(t->capacity)) { return t->capacity; }
+  if (t->count + t->tombstones + 1 > TABLE_MAX_LOAD(t->capacity))
+  {
+    return GROW_TABLE(t->capacity);
+  }
+  return t->capacity;
+}
 
-  e->key = NULL;
-  e->value = BOOL_VAL(true);
-  return true; 
+size_t table_insert_bytes(table* t)
+{
+  int capacity = insert_capacity(t);
+  return capacity == t->capacity ? 0 : table_bytes(capacity);
 }
 
 bool table_set(table* t, obj_string* key, value v)
 {
-  if (t->count+1 > t->capacity * TABLE_MAX_LOAD)
+  int index = t->count == 0 ? -1 : find_slot(t, key);
+  if (index >= 0)
+  {
+    t->entries[index].value = v;
+    return false;
+  }
+
+  int capacity = insert_capacity(t);
+  if (capacity != t->capacity)
   {
-    int capacity = GROW_CAPACITY(t->capacity);
     adjust_capacity(t, capacity);
   }
-  entry* e = find_entry(t->entries, t->capacity, key);
-  bool is_new = e->key == NULL;
-  if (is_new && IS_NIL(e->value)) 
+  else if (t->tombstones > TABLE_MAX_TOMBSTONES(t->capacity))
   {
-    t->count++;
+    rehash_in_place(t);
   }
-  e->key = key;
-  e->value = v;
-  return is_new;
-}
\ No newline at end of file
+  int probes;
+  index = free_slot(t, key->hash, &probes);
+  if (t->control[index] == CONTROL_DELETED) { t->tombstones--; }
+  place(t, index, probes, key, v);
+  t->count++;
+  return true;
+}
+
+void mark_table(table* t)
+{
+  for (int i = 0; i < t->capacity; i++)
+  {
+    if (t->control[i] & 0x80) { continue; }
+    mark_object((obj*)t->entries[i].key);
+    mark_value(t->entries[i].value);
+  }
+}
+
+// how many groups a lookup of each key looks at, 1 for a key in its home
+// group. counts[buckets - 1] also takes everything longer
+void table_probe_lengths(table* t, uint64_t* counts, int buckets)
+{
+  int groups = t->capacity / TABLE_GROUP_WIDTH;
+  for (int i = 0; i < t->capacity; i++)
+  {
+    if (t->control[i] & 0x80) { continue; }
+    int group = home_group(t->entries[i].key->hash, groups);
+    int length = 1;
+    while (group != i / TABLE_GROUP_WIDTH)
+    {
+      group = next_group(group, length - 1, groups);
+      length++;
+    }
+    counts[length < buckets ? length - 1 : buckets - 1]++;
+  }
+}
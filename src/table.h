@@ -4,23 +4,39 @@
 #include "common.h"
 #include "value.h"
 
+// every slot has a control byte next to the entries: the low 7 bits of
+// the key's hash while it is full, or one of the markers below. lookups
+// compare a whole group of control bytes at once and only look at the
+// entries whose byte matches
+#define TABLE_GROUP_WIDTH 16
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+
 typedef struct {
-  obj_string* key;
+  obj_string* key;  // NULL unless the slot is full
   value value;
 } entry;
 
 typedef struct {
-  int count;
-  int capacity;
-  entry* entries; 
+  int count;        // live entries
+  int tombstones;
+  int capacity;     // 0 or a power of two, at least one group
+  int max_probe;    // groups the furthest key sits from its home group
+  uint32_t generation; // bumped whenever entries move to other slots
+  entry* entries;
+  uint8_t* control; // capacity bytes behind the entries, same allocation
 } table;
 
 void init_table(table* t);
 void free_table(table* t);
 bool table_set(table* t, obj_string* key, value v);
+size_t table_insert_bytes(table* t); // what table_set allocates for a new key
 bool table_get(table* t, obj_string* key, value* v);
 bool table_delete(table* t, obj_string* key);
 void table_add_all(table* from, table* to);
 obj_string* table_find_string(table* t, const char* chars, int length, uint32_t hash);
+void table_replace_key(table* t, obj_string* key, obj_string* moved);
+void mark_table(table* t);
+void table_probe_lengths(table* t, uint64_t* counts, int buckets);
 
 #endif 
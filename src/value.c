@@ -7,6 +7,14 @@
 
 bool values_equal(value a, value b)
 {
+#ifdef NAN_BOXING
+  // compare numbers as doubles so NaN != NaN, everything else by its bits
+  if (IS_NUMBER(a) && IS_NUMBER(b))
+  {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b;
+#else
   if (a.type != b.type) { return false; }
   switch (a.type)
   {
@@ -16,6 +24,7 @@ bool values_equal(value a, value b)
     case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
     default: return false; // unreachable 
   }
+#endif
 }
 
 void init_value_array(value_array* arr)
@@ -43,12 +52,20 @@ void free_value_array(value_array* arr)
 
 void print_value(value v)
 {
+#ifdef NAN_BOXING
+  if (IS_BOOL(v)) { printf(AS_BOOL(v) ? "true" : "false"); }
+  else if (IS_NIL(v)) { printf("nil"); }
+  else if (IS_NUMBER(v)) { printf("%g", AS_NUMBER(v)); }
+  else if (IS_OBJ(v)) { print_object(v); }
+#else
   switch (v.type)
   {
   case VAL_BOOL: printf(AS_BOOL(v) ? "true" : "false");
   break; case VAL_NIL: printf("nil"); 
   break; case VAL_NUMBER: printf("%g", AS_NUMBER(v));
   break; case VAL_OBJ: print_object(v); 
-  break;
+  // only marks undefined global slots, lox code never gets to print one
+  break; case VAL_UNDEFINED: break;
   }
+#endif
 }
\ No newline at end of file
@@ -7,11 +7,64 @@ typedef struct obj obj;
 typedef struct obj_string obj_string;
 
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// every value is a 64 bit double. everything that is not a number hides in
+// the payload of a quiet NaN: singletons use the low tag bits, objects set
+// the sign bit and keep their 48 bit pointer in the mantissa
+#define SIGN_BIT  ((uint64_t)0x8000000000000000)
+#define QNAN      ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01
+#define TAG_FALSE 2 // 10
+#define TAG_TRUE  3 // 11
+#define TAG_UNDEFINED 4 // 100
+
+typedef uint64_t value;
+
+#define FALSE_VAL     ((value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL      ((value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(v)    (((v) | 1) == TRUE_VAL)
+#define IS_NIL(v)     ((v) == NIL_VAL)
+#define IS_NUMBER(v)  (((v) & QNAN) != QNAN)
+#define IS_OBJ(v)     (((v) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(v) ((v) == UNDEFINED_VAL)
+
+#define AS_BOOL(v)    ((v) == TRUE_VAL)
+#define AS_NUMBER(v)  value_to_num(v)
+#define AS_OBJ(v)     ((obj*)(uintptr_t)((v) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(v)   ((v) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL       ((value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(v) num_to_value(v)
+#define OBJ_VAL(v)    ((value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(v)))
+#define UNDEFINED_VAL ((value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+static inline double value_to_num(value v)
+{
+  double num;
+  memcpy(&num, &v, sizeof(value));
+  return num;
+}
+
+static inline value num_to_value(double num)
+{
+  value v;
+  memcpy(&v, &num, sizeof(double));
+  return v;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
-  VAL_OBJ 
+  VAL_OBJ,
+  VAL_UNDEFINED // marks global slots that were never defined, never seen by lox code
 } value_type;
 
 typedef struct {
@@ -27,6 +80,7 @@ typedef struct {
 #define IS_NIL(v)     ((v).type == VAL_NIL)
 #define IS_NUMBER(v)  ((v).type == VAL_NUMBER)
 #define IS_OBJ(v)     ((v).type == VAL_OBJ)
+#define IS_UNDEFINED(v) ((v).type == VAL_UNDEFINED)
 
 #define AS_BOOL(v)    ((v).as.boolean)
 #define AS_NUMBER(v)  ((v).as.number)
@@ -36,8 +90,9 @@ typedef struct {
 #define NIL_VAL       ((value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(v) ((value){VAL_NUMBER, {.number = v}})
 #define OBJ_VAL(v)    ((value){VAL_OBJ, {.object = (obj*)v}})
+#define UNDEFINED_VAL ((value){VAL_UNDEFINED, {.number = 0}})
 
-
+#endif
 
 typedef struct {
   int capacity;
@@ -1,4 +1,6 @@
+#include <limits.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -7,8 +9,12 @@
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "pool.h"
 #include "vm.h"
 #include "compiler.h"
+#include "jit.h"
+#include "profiler.h"
+#include "stats.h"
 
 vm g_vm;
 
@@ -17,6 +23,21 @@ static value clock_native(int arg_count, value* args)
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static value heap_allocated_native(int arg_count, value* args)
+{
+  return NUMBER_VAL((double)g_vm.bytes_allocated);
+}
+
+static value heap_peak_native(int arg_count, value* args)
+{
+  return NUMBER_VAL((double)g_vm.heap_peak);
+}
+
+static value heap_limit_native(int arg_count, value* args)
+{
+  return NUMBER_VAL((double)g_vm.heap_limit);
+}
+
 static void reset_stack()
 {
   g_vm.stack_top = g_vm.stack;
@@ -50,11 +71,45 @@ static void runtime_error(const char* format, ...)
   reset_stack();
 }
 
+// globals are resolved to a stable slot the first time the compiler sees
+// their name. the slot stays undefined until OP_DEFINE_GLOBAL runs, which
+// keeps late binding and redefinition in the repl working
+int global_slot(obj_string* name)
+{
+  value slot;
+  if (table_get(&g_vm.global_slots, name, &slot))
+  {
+    return (int)AS_NUMBER(slot);
+  }
+  push(OBJ_VAL(name));
+#ifdef GENERATIONAL_GC
+  int capacity = g_vm.global_values.capacity;
+#endif
+  write_value_array(&g_vm.global_names, OBJ_VAL(name));
+  write_value_array(&g_vm.global_values, UNDEFINED_VAL);
+  int index = g_vm.global_values.count - 1;
+  table_set(&g_vm.global_slots, name, NUMBER_VAL((double)index));
+  pop();
+#ifdef GENERATIONAL_GC
+  if (g_vm.global_values.capacity != capacity)
+  {
+    g_vm.global_remembered = (bool*)realloc(g_vm.global_remembered, 
+      sizeof(bool) * g_vm.global_values.capacity);
+    if (g_vm.global_remembered == NULL) { exit(1); }
+    memset(g_vm.global_remembered + capacity, 0, 
+      sizeof(bool) * (g_vm.global_values.capacity - capacity));
+  }
+  global_barrier(index, OBJ_VAL(name));
+#endif
+  return index;
+}
+
 static void define_native(const char* name, native_func func)
 {
   push(OBJ_VAL(copy_string(name, (int)strlen(name))));
   push(OBJ_VAL(new_native(func)));
-  table_set(&g_vm.globals, AS_STRING(g_vm.stack[0]), g_vm.stack[1]);
+  int slot = global_slot(AS_STRING(g_vm.stack[0]));
+  g_vm.global_values.values[slot] = g_vm.stack[1];
   pop();
   pop();
 }
@@ -63,16 +118,72 @@ void init_vm()
 {
   reset_stack();
   g_vm.objects = NULL;
-  init_table(&g_vm.globals);
+  g_vm.bytes_allocated = 0;
+  g_vm.next_gc = GC_MIN_HEAP;
+  g_vm.heap_peak = 0;
+  g_vm.heap_limit = 0;
+  g_vm.limit_suspended = 0;
+  g_vm.heap_handler = NULL;
+  g_vm.gray_count = 0;
+  g_vm.gray_capacity = 0;
+  g_vm.gray_stack = NULL;
+  g_vm.gc_mode = GC_STOP_THE_WORLD;
+  g_vm.gc_phase = GC_IDLE;
+  g_vm.gc_budget = GC_STEP_BUDGET;
+  g_vm.sweeping = NULL;
+  g_vm.strings_cursor = 0;
+  g_vm.strings_generation = 0;
+  g_vm.gc_cycles = 0;
+  g_vm.minor_collections = 0;
+  g_vm.gc_stats = false;
+#ifdef GENERATIONAL_GC
+  g_vm.nursery = (uint8_t*)malloc(NURSERY_SIZE);
+  if (g_vm.nursery == NULL) { exit(1); }
+  g_vm.nursery_top = g_vm.nursery;
+  g_vm.nursery_end = g_vm.nursery + NURSERY_SIZE;
+  g_vm.remembered = NULL;
+  g_vm.remembered_count = 0;
+  g_vm.remembered_capacity = 0;
+  g_vm.remembered_globals = NULL;
+  g_vm.remembered_globals_count = 0;
+  g_vm.remembered_globals_capacity = 0;
+  g_vm.global_remembered = NULL;
+#endif
+  init_table(&g_vm.global_slots);
+  init_value_array(&g_vm.global_names);
+  init_value_array(&g_vm.global_values);
   init_table(&g_vm.strings);
+  // main() may have asked for a fixed seed, nothing is hashed before this
+  g_vm.hash_seed = make_hash_seed(g_vm.hash_seed);
+  g_vm.jit_enabled = true;
 
   define_native("clock", clock_native);
+  define_native("heap_allocated", heap_allocated_native);
+  define_native("heap_peak", heap_peak_native);
+  define_native("heap_limit", heap_limit_native);
 }
 void free_vm()
 {
-  free_table(&g_vm.globals);
+  free_table(&g_vm.global_slots);
+  free_value_array(&g_vm.global_names);
+  free_value_array(&g_vm.global_values);
   free_table(&g_vm.strings);
   free_objects();
+  free(g_vm.gray_stack);
+#ifdef GENERATIONAL_GC
+  free(g_vm.remembered);
+  free(g_vm.remembered_globals);
+  free(g_vm.global_remembered);
+#endif
+  free_pool();
+}
+
+// 0 lifts the limit. collections start at the limit at the latest, an
+// allocation that would still go over it is a runtime error
+void set_heap_limit(size_t bytes)
+{
+  g_vm.heap_limit = bytes;
+  if (bytes != 0 && g_vm.next_gc > bytes) { g_vm.next_gc = bytes; }
 }
 
 void push(value v)
@@ -104,6 +215,9 @@ static bool call(obj_function* func, int arg_count)
     return false;
   } 
 
+#ifdef VM_STATS
+  func->calls++;
+#endif
   call_frame* frame = &g_vm.frames[g_vm.frame_count++];
   frame->function = func; 
   frame->ip = func->chunk.code;
@@ -111,6 +225,28 @@ static bool call(obj_function* func, int arg_count)
   return true;
 }
 
+// a call in tail position reuses the caller's frame: callee and arguments
+// slide down over the caller's slots, so tail recursion runs in constant
+// frame space
+static bool tail_call(call_frame* frame, obj_function* func, int arg_count)
+{
+  if (arg_count != func->arity)
+  {
+    runtime_error("Expected %d arguments but got %d.", func->arity, arg_count);
+    return false;
+  }
+
+#ifdef VM_STATS
+  func->calls++;
+#endif
+  value* callee = g_vm.stack_top - arg_count - 1;
+  memmove(frame->slots, callee, sizeof(value) * (arg_count + 1));
+  g_vm.stack_top = frame->slots + arg_count + 1;
+  frame->function = func;
+  frame->ip = func->chunk.code;
+  return true;
+}
+
 static bool call_value(value callee, int arg_count)
 {
   if (IS_OBJ(callee))
@@ -141,172 +277,539 @@ static bool is_falsey(value v)
   return IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v)); 
 }
 
-static void concatenate()
+// the two strings on top of the stack as one interned string
+static obj_string* join_strings()
+{
+  int length = AS_STRING(peek(0))->length + AS_STRING(peek(1))->length;
+  reserve_heap(string_size(length));
+  obj_string* str = new_string(length);
+  obj_string* b = AS_STRING(peek(0));
+  obj_string* a = AS_STRING(peek(1));
+  memcpy(str->chars, a->chars, a->length);
+  memcpy(str->chars + a->length, b->chars, b->length);
+  return intern_string(str);
+}
+
+// appending a short string to a rope that ends in one joins the two, the
+// rope's left side takes its place. a string built piece by piece then
+// ends up with leaves of about ROPE_MIN_LENGTH instead of a node per piece
+static void merge_tail()
+{
+  if (!IS_STRING(peek(0)) || !IS_ROPE(peek(1))) { return; }
+  obj_rope* rope = AS_ROPE(peek(1));
+  if (rope->flat != NULL || rope->right->type != OBJ_STRING 
+    || ((obj_string*)rope->right)->length + AS_STRING(peek(0))->length >= ROPE_MIN_LENGTH)
+  {
+    return;
+  }
+  // the rope keeps both of its sides alive until they are on the stack
+  push(OBJ_VAL(rope->right));
+  push(peek(1));
+  obj_string* tail = join_strings();
+  pop();
+  pop();
+  g_vm.stack_top[-1] = OBJ_VAL(tail);
+  g_vm.stack_top[-2] = OBJ_VAL(AS_ROPE(peek(1))->left);
+}
+
+// the operands stay on the stack until the result exists, allocating
+// may collect. long results are ropes, short ones are copied right away
+static bool concatenate()
 {
-  obj_string* b = AS_STRING(pop());
-  obj_string* a = AS_STRING(pop());
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length+1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+  int64_t length = (int64_t)text_length(peek(0)) + text_length(peek(1));
+  if (length > INT_MAX)
+  {
+    runtime_error("String too long.");
+    return false;
+  }
 
-  obj_string* result = take_string(chars, length);
+  obj* result;
+  if (length >= ROPE_MIN_LENGTH)
+  {
+    merge_tail();
+    result = (obj*)new_rope(&g_vm.stack_top[-2], &g_vm.stack_top[-1]);
+  }
+  else
+  {
+    // no rope is this short, both sides are strings
+    result = (obj*)join_strings();
+  }
+  pop();
+  pop();
   push(OBJ_VAL(result));
+  return true;
 }
 
-static interpret_result run() 
+// ropes are compared as the interned strings they stand for. only text of
+// the same length needs flattening, a rope is never equal to anything else
+static void flatten_operands()
+{
+  value a = peek(1);
+  value b = peek(0);
+  if (!IS_TEXT(a) || !IS_TEXT(b) || AS_OBJ(a) == AS_OBJ(b)
+    || text_length(a) != text_length(b))
+  {
+    return;
+  }
+  for (value* slot = g_vm.stack_top - 2; slot < g_vm.stack_top; slot++)
+  {
+    if (IS_ROPE(*slot)) { *slot = OBJ_VAL(flatten_rope(AS_ROPE(*slot))); }
+  }
+}
+
+#ifdef DEBUG_TRACE_EXTENSION
+static void trace_instruction(call_frame* frame, uint8_t* ip)
+{
+  printf("        ");
+  for (value* slot = g_vm.stack; slot < g_vm.stack_top; slot++)
+  {
+    printf("[ ");
+    print_value(*slot);
+    printf(" ]");
+  }
+  printf("\n");
+  disassemble_instruction(&frame->function->chunk, (int)(ip - frame->function->chunk.code));
+}
+#define TRACE_INSTRUCTION() trace_instruction(frame, ip)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef VM_STATS
+#define COUNT_INSTRUCTION() count_instruction(frame->function, *ip)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef GENERATIONAL_GC
+#define GLOBAL_BARRIER(slot, v) global_barrier(slot, v)
+#else
+#define GLOBAL_BARRIER(slot, v) ((void)0)
+#endif
+
+#ifdef JIT
+static interpret_result run(int exit_depth);
+
+// runs a frame in machine code until it returns. a tail call into a
+// function that has none yet hands the frame back to the interpreter
+static interpret_result run_native(call_frame* frame)
+{
+  for (;;)
+  {
+    switch (jit_enter(frame))
+    {
+      case JIT_RETURNED: return INTERPRET_OK;
+      case JIT_ERROR: return INTERPRET_RUNTIME_ERROR;
+      case JIT_TAIL_CALLED:
+        if (!jit_ready(frame->function)) return run(g_vm.frame_count - 1);
+    }
+  }
+}
+
+// moves the topmost frame to machine code once its function is hot. true
+// if it ran there, the frame has returned by then
+static bool try_native(interpret_result* result)
+{
+  call_frame* top = &g_vm.frames[g_vm.frame_count-1];
+  if (!g_vm.jit_enabled || !jit_ready(top->function)) return false;
+  *result = run_native(top);
+  return true;
+}
+
+bool jit_binary(uint8_t op)
+{
+  value b = peek(0);
+  value a = peek(1);
+  if (op == OP_EQUAL)
+  {
+    flatten_operands();
+    b = peek(0);
+    a = peek(1);
+    pop();
+    pop();
+    push(BOOL_VAL(values_equal(a, b)));
+    return true;
+  }
+  if (op == OP_ADD && IS_TEXT(a) && IS_TEXT(b))
+  {
+    return concatenate();
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b))
+  {
+    runtime_error(op == OP_ADD ? "Operands must be two numbers or two strings"
+                               : "Operand must be numbers.");
+    return false;
+  }
+  pop();
+  pop();
+  switch (op)
+  {
+    case OP_ADD:      push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+    break; case OP_SUBTRACT: push(NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+    break; case OP_MULTIPLY: push(NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b)));
+    break; case OP_DIVIDE:   push(NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)));
+    break; case OP_GREATER:  push(BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b)));
+    break; case OP_LESS:     push(BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)));
+  }
+  return true;
+}
+
+bool jit_unary(uint8_t op)
+{
+  switch (op)
+  {
+    case OP_NOT: push(BOOL_VAL(is_falsey(pop())));
+    break; case OP_NEGATE:
+      if (!IS_NUMBER(peek(0)))
+      {
+        runtime_error("Operand must be a number.");
+        return false;
+      }
+      push(NUMBER_VAL(-AS_NUMBER(pop())));
+    break; case OP_PRINT:
+      print_value(pop());
+      printf("\n");
+  }
+  return true;
+}
+
+bool jit_global(uint8_t op, uint16_t slot)
+{
+  value* v = &g_vm.global_values.values[slot];
+  if (op == OP_DEFINE_GLOBAL)
+  {
+    *v = pop();
+    GLOBAL_BARRIER(slot, *v);
+    return true;
+  }
+  if (IS_UNDEFINED(*v))
+  {
+    runtime_error("Undefined variable '%s'.",
+                  AS_STRING(g_vm.global_names.values[slot])->chars);
+    return false;
+  }
+  switch (op)
+  {
+    case OP_GET_GLOBAL: push(*v);
+    break; case OP_SET_GLOBAL: *v = peek(0);
+    break; case OP_SET_GLOBAL_POP: *v = pop();
+  }
+  GLOBAL_BARRIER(slot, *v);
+  return true;
+}
+
+// the callee runs to completion before this returns, natively if it is hot
+bool jit_call(int arg_count)
+{
+  int depth = g_vm.frame_count;
+  if (!call_value(peek(arg_count), arg_count)) return false;
+  if (g_vm.frame_count == depth) return true; // a native, already done
+
+  interpret_result result;
+  if (!try_native(&result)) result = run(depth);
+  return result == INTERPRET_OK;
+}
+
+jit_status jit_tail_call(call_frame* frame, int arg_count)
+{
+  value callee = peek(arg_count);
+  if (IS_FUNCTION(callee))
+  {
+    return tail_call(frame, AS_FUNCTION(callee), arg_count) ? JIT_TAIL_CALLED : JIT_ERROR;
+  }
+  return call_value(callee, arg_count) ? JIT_RETURNED : JIT_ERROR;
+}
+
+void jit_return(call_frame* frame)
+{
+  value result = pop();
+  g_vm.frame_count--;
+  if (g_vm.frame_count == 0)
+  {
+    pop();
+    return;
+  }
+  g_vm.stack_top = frame->slots;
+  push(result);
+}
+#endif
+
+// runs the topmost frame and everything it calls until the frame count
+// drops to `exit_depth`, 0 runs the whole script
+static interpret_result run(int exit_depth)
 {
 
   call_frame* frame = &g_vm.frames[g_vm.frame_count-1];
+  // the instruction pointer lives in a register while inside run() and is
+  // only written back to the frame when someone else needs to see it
+  register uint8_t* ip = frame->ip;
 
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+  (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define GLOBAL_NAME(slot) AS_STRING(g_vm.global_names.values[slot])->chars
+#define RUNTIME_ERROR(...) \
+  do { \
+    frame->ip = ip; \
+    runtime_error(__VA_ARGS__); \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
 #define BINARY_OP(value_t, op) \
   do { \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtime_error("Operand must be numbers."); \
-      return INTERPRET_RUNTIME_ERROR; \
+      RUNTIME_ERROR("Operand must be numbers."); \
     } \
     double b = AS_NUMBER(pop()); \
     double a = AS_NUMBER(pop()); \
     push(value_t(a op b)); \
   } while (false)
+#ifdef JIT
+// calls and back-edges are where a frame can move to machine code, the
+// interpreter continues with whichever frame is on top once it comes back
+#define TRY_NATIVE() \
+  do { \
+    interpret_result result; \
+    frame->ip = ip; \
+    if (try_native(&result)) { \
+      if (result != INTERPRET_OK) return result; \
+      if (g_vm.frame_count == exit_depth) return INTERPRET_OK; \
+      frame = &g_vm.frames[g_vm.frame_count-1]; \
+      ip = frame->ip; \
+    } \
+  } while (false)
+#else
+#define TRY_NATIVE() ((void)0)
+#endif
+#ifdef PROFILER
+// calls and back-edges are the safe points where a pending sample is taken
+#define SAMPLE() \
+  do { \
+    if (g_sample_pending) { \
+      frame->ip = ip; \
+      take_sample(); \
+    } \
+  } while (false)
+#else
+#define SAMPLE() ((void)0)
+#endif
+#define ADD_OP() \
+  do { \
+    if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) { \
+      frame->ip = ip; \
+      if (!concatenate()) return INTERPRET_RUNTIME_ERROR; \
+    } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) { \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(NUMBER_VAL(a+b)); \
+    } else { \
+      RUNTIME_ERROR("Operands must be two numbers or two strings"); \
+    } \
+  } while (false)
 
-  for(;;)
-  {
-#ifdef DEBUG_TRACE_EXTENSION
-  printf("        ");
-  for (value* slot = g_vm.stack; slot < g_vm.stack_top; slot++)
-  {
-    printf("[ ");
-    print_value(*slot);
-    printf(" ]");
+// with COMPUTED_GOTO every handler ends in its own indirect jump to the
+// next handler, otherwise NEXT falls back to the switch at the loop head
+#ifdef COMPUTED_GOTO
+  static void* dispatch_table[] = {
+    [OP_CONSTANT]       = &&L_OP_CONSTANT,
+    [OP_NIL]            = &&L_OP_NIL,
+    [OP_TRUE]           = &&L_OP_TRUE,
+    [OP_FALSE]          = &&L_OP_FALSE,
+    [OP_POP]            = &&L_OP_POP,
+    [OP_GET_LOCAL]      = &&L_OP_GET_LOCAL,
+    [OP_SET_LOCAL]      = &&L_OP_SET_LOCAL,
+    [OP_GET_GLOBAL]     = &&L_OP_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL]  = &&L_OP_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL]     = &&L_OP_SET_GLOBAL,
+    [OP_EQUAL]          = &&L_OP_EQUAL,
+    [OP_GREATER]        = &&L_OP_GREATER,
+    [OP_LESS]           = &&L_OP_LESS,
+    [OP_NEGATE]         = &&L_OP_NEGATE,
+    [OP_PRINT]          = &&L_OP_PRINT,
+    [OP_JUMP]           = &&L_OP_JUMP,
+    [OP_JUMP_IF_FALSE]  = &&L_OP_JUMP_IF_FALSE,
+    [OP_LOOP]           = &&L_OP_LOOP,
+    [OP_ADD]            = &&L_OP_ADD,
+    [OP_SUBTRACT]       = &&L_OP_SUBTRACT,
+    [OP_MULTIPLY]       = &&L_OP_MULTIPLY,
+    [OP_DIVIDE]         = &&L_OP_DIVIDE,
+    [OP_NOT]            = &&L_OP_NOT,
+    [OP_CALL]           = &&L_OP_CALL,
+    [OP_TAIL_CALL]      = &&L_OP_TAIL_CALL,
+    [OP_RETURN]         = &&L_OP_RETURN,
+    [OP_ADD_CONSTANT]       = &&L_OP_ADD_CONSTANT,
+    [OP_SUBTRACT_CONSTANT]  = &&L_OP_SUBTRACT_CONSTANT,
+    [OP_LESS_CONSTANT]      = &&L_OP_LESS_CONSTANT,
+    [OP_GET_LOCALS]         = &&L_OP_GET_LOCALS,
+    [OP_SET_LOCAL_POP]      = &&L_OP_SET_LOCAL_POP,
+    [OP_SET_GLOBAL_POP]     = &&L_OP_SET_GLOBAL_POP,
+    [OP_POP_JUMP_IF_FALSE]  = &&L_OP_POP_JUMP_IF_FALSE,
+    [OP_ADD_NUMBER]         = &&L_OP_ADD_NUMBER,
+    [OP_ADD_STRING]         = &&L_OP_ADD_STRING,
+    [OP_ADD_CONSTANT_NUMBER]= &&L_OP_ADD_CONSTANT_NUMBER,
+    [OP_EQUAL_NUMBER]       = &&L_OP_EQUAL_NUMBER,
+  };
+#define DISPATCH_LOOP NEXT;
+#define CASE(op) L_##op
+#define NEXT \
+  do { \
+    TRACE_INSTRUCTION(); \
+    COUNT_INSTRUCTION(); \
+    goto *dispatch_table[READ_BYTE()]; \
+  } while (false)
+#else
+#define DISPATCH_LOOP for (;;) switch (TRACE_INSTRUCTION(), COUNT_INSTRUCTION(), READ_BYTE())
+#define CASE(op) case op
+#define NEXT break
+#endif
+
+// a quickened instruction whose guard failed turns back into its generic
+// form and is dispatched again, `size` is how far ip has moved past it
+#define DESPECIALIZE(op, size) \
+  { \
+    ip -= size; \
+    *ip = op; \
+    NEXT; \
   }
-  printf("\n");
-  disassemble_instruction(&frame->function->chunk, (int)(frame->ip - frame->function->chunk.code));
-#endif 
+#define NUMBERS(a, b) (IS_NUMBER(a) && IS_NUMBER(b))
 
-    uint8_t instruction; 
-    switch (instruction = READ_BYTE()) 
-    {
-      case OP_CONSTANT:
+  DISPATCH_LOOP
+  {
+      CASE(OP_CONSTANT):
       {
         value constant = READ_CONSTANT();
         push(constant);
       }
-      break; case OP_NIL: push(NIL_VAL);
-      break; case OP_TRUE: push(BOOL_VAL(true));
-      break; case OP_FALSE: push(BOOL_VAL(false));
-      break; case OP_POP: pop(); 
-      break; case OP_SET_LOCAL: 
+      NEXT; CASE(OP_NIL): push(NIL_VAL);
+      NEXT; CASE(OP_TRUE): push(BOOL_VAL(true));
+      NEXT; CASE(OP_FALSE): push(BOOL_VAL(false));
+      NEXT; CASE(OP_POP): pop(); 
+      NEXT; CASE(OP_SET_LOCAL): 
       {
         uint8_t slot = READ_BYTE();
         frame->slots[slot] = peek(0);
       }
-      break; case OP_GET_LOCAL: 
+      NEXT; CASE(OP_GET_LOCAL): 
       {
         uint8_t slot = READ_BYTE();
         push(frame->slots[slot]);
       }
-      break; case OP_GET_GLOBAL:
+      NEXT; CASE(OP_GET_GLOBAL):
       {
-        obj_string* name = READ_STRING();
-        value v; 
-        if (!table_get(&g_vm.globals, name, &v))
+        uint16_t slot = READ_SHORT();
+        value v = g_vm.global_values.values[slot];
+        if (IS_UNDEFINED(v))
         {
-          runtime_error("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
         }
         else 
         {
           push(v);
         }
       }
-      break; case OP_DEFINE_GLOBAL:
+      NEXT; CASE(OP_DEFINE_GLOBAL):
       {
-        obj_string* name = READ_STRING();
-        table_set(&g_vm.globals, name, peek(0));
+        uint16_t slot = READ_SHORT();
+        g_vm.global_values.values[slot] = peek(0);
+        GLOBAL_BARRIER(slot, peek(0));
         pop();
       }
-      break; case OP_SET_GLOBAL:
+      NEXT; CASE(OP_SET_GLOBAL):
       {
-        obj_string* name = READ_STRING();
-        if (table_set(&g_vm.globals, name, peek(0)))
+        uint16_t slot = READ_SHORT();
+        value* v = &g_vm.global_values.values[slot];
+        if (IS_UNDEFINED(*v))
         {
-          table_delete(&g_vm.globals, name);
-          runtime_error("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
         }
+        *v = peek(0);
+        GLOBAL_BARRIER(slot, *v);
       }
-      break; case OP_EQUAL:
+      NEXT; CASE(OP_EQUAL):
+      {
+        if (NUMBERS(peek(0), peek(1))) { ip[-1] = OP_EQUAL_NUMBER; }
+        else if (IS_ROPE(peek(0)) || IS_ROPE(peek(1)))
+        {
+          frame->ip = ip;
+          flatten_operands();
+        }
         value a = pop();
         value b = pop();
         push(BOOL_VAL(values_equal(a,b)));
-      break; case OP_GREATER:          BINARY_OP(BOOL_VAL, >);
-      break; case OP_LESS:             BINARY_OP(BOOL_VAL, <);
-      break; case OP_ADD:         
+      }
+      NEXT; CASE(OP_GREATER):          BINARY_OP(BOOL_VAL, >);
+      NEXT; CASE(OP_LESS):             BINARY_OP(BOOL_VAL, <);
+      NEXT; CASE(OP_ADD):         
       {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
-        {
-          concatenate();
-        }
-        else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-        {
-          double a = AS_NUMBER(pop());
-          double b = AS_NUMBER(pop());
-          push(NUMBER_VAL(a+b));
-        }
-        else 
-        {
-          runtime_error("Operands must be two numbers or two strings");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+        if (NUMBERS(peek(0), peek(1))) { ip[-1] = OP_ADD_NUMBER; }
+        else if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) { ip[-1] = OP_ADD_STRING; }
+        ADD_OP();
       }
-      break; case OP_SUBTRACT:    BINARY_OP(NUMBER_VAL, -);
-      break; case OP_MULTIPLY:    BINARY_OP(NUMBER_VAL, *);
-      break; case OP_DIVIDE:      BINARY_OP(NUMBER_VAL, /);
-      break; case OP_NOT: push(BOOL_VAL(is_falsey(pop())));
-      break; case OP_NEGATE: 
+      NEXT; CASE(OP_SUBTRACT):    BINARY_OP(NUMBER_VAL, -);
+      NEXT; CASE(OP_MULTIPLY):    BINARY_OP(NUMBER_VAL, *);
+      NEXT; CASE(OP_DIVIDE):      BINARY_OP(NUMBER_VAL, /);
+      NEXT; CASE(OP_NOT): push(BOOL_VAL(is_falsey(pop())));
+      NEXT; CASE(OP_NEGATE): 
         if (!IS_NUMBER(peek(0))) 
         {
-          runtime_error("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operand must be a number.");
         }
         push(NUMBER_VAL(-AS_NUMBER(pop())));  
-      break; case OP_PRINT:
+      NEXT; CASE(OP_PRINT):
       {
         print_value(pop());
         printf("\n");
       }
-      break; case OP_JUMP:
+      NEXT; CASE(OP_JUMP):
       {
         uint16_t offset = READ_SHORT();
-        frame->ip += offset; 
+        ip += offset; 
       } 
-      break; case OP_JUMP_IF_FALSE: 
+      NEXT; CASE(OP_JUMP_IF_FALSE): 
       {
         uint16_t offset = READ_SHORT();
-        if (is_falsey(peek(0))) frame->ip += offset;
+        if (is_falsey(peek(0))) ip += offset;
       }
-      break; case OP_LOOP:
+      NEXT; CASE(OP_LOOP):
       {
         uint16_t offest = READ_SHORT();
-        frame->ip -= offest;
+        ip -= offest;
+        SAMPLE();
+        TRY_NATIVE();
       } 
-      break; case OP_CALL: 
+      NEXT; CASE(OP_CALL): 
       {
         int arg_count = READ_BYTE();
+        SAMPLE();
+        frame->ip = ip;
         if (!call_value(peek(arg_count), arg_count)) 
         {
           return INTERPRET_RUNTIME_ERROR;
         }
         frame = &g_vm.frames[g_vm.frame_count-1];
+        ip = frame->ip;
+        TRY_NATIVE();
+      }
+      NEXT; CASE(OP_TAIL_CALL): 
+      {
+        int arg_count = READ_BYTE();
+        SAMPLE();
+        value callee = peek(arg_count);
+        frame->ip = ip;
+        if (IS_FUNCTION(callee))
+        {
+          if (!tail_call(frame, AS_FUNCTION(callee), arg_count))
+          {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+        }
+        else if (!call_value(callee, arg_count))
+        {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ip = frame->ip;
       }
-      break; case OP_RETURN: 
+      NEXT; CASE(OP_RETURN): 
       {
         value result = pop();
         g_vm.frame_count--;
@@ -319,23 +822,134 @@ static interpret_result run()
         {
           g_vm.stack_top = frame->slots;
           push(result);
+          if (g_vm.frame_count == exit_depth) return INTERPRET_OK;
           frame = &g_vm.frames[g_vm.frame_count-1];
-          break;
+          ip = frame->ip;
         }
       }
-    }
+      NEXT; CASE(OP_ADD_CONSTANT):
+      {
+        value constant = READ_CONSTANT();
+        if (NUMBERS(constant, peek(0))) { ip[-2] = OP_ADD_CONSTANT_NUMBER; }
+        push(constant);
+        ADD_OP();
+      }
+      NEXT; CASE(OP_SUBTRACT_CONSTANT):
+      {
+        push(READ_CONSTANT());
+        BINARY_OP(NUMBER_VAL, -);
+      }
+      NEXT; CASE(OP_LESS_CONSTANT):
+      {
+        push(READ_CONSTANT());
+        BINARY_OP(BOOL_VAL, <);
+      }
+      NEXT; CASE(OP_GET_LOCALS):
+      {
+        uint8_t a = READ_BYTE();
+        uint8_t b = READ_BYTE();
+        push(frame->slots[a]);
+        push(frame->slots[b]);
+      }
+      NEXT; CASE(OP_SET_LOCAL_POP):
+      {
+        uint8_t slot = READ_BYTE();
+        frame->slots[slot] = pop();
+      }
+      NEXT; CASE(OP_SET_GLOBAL_POP):
+      {
+        uint16_t slot = READ_SHORT();
+        value* v = &g_vm.global_values.values[slot];
+        if (IS_UNDEFINED(*v))
+        {
+          RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+        }
+        *v = pop();
+        GLOBAL_BARRIER(slot, *v);
+      }
+      NEXT; CASE(OP_POP_JUMP_IF_FALSE):
+      {
+        uint16_t offset = READ_SHORT();
+        if (is_falsey(pop())) ip += offset;
+      }
+      NEXT; CASE(OP_ADD_NUMBER):
+      {
+        if (!NUMBERS(peek(0), peek(1))) DESPECIALIZE(OP_ADD, 1);
+        double b = AS_NUMBER(pop());
+        g_vm.stack_top[-1] = NUMBER_VAL(AS_NUMBER(peek(0)) + b);
+      }
+      NEXT; CASE(OP_ADD_STRING):
+      {
+        if (!IS_TEXT(peek(0)) || !IS_TEXT(peek(1))) DESPECIALIZE(OP_ADD, 1);
+        frame->ip = ip;
+        if (!concatenate()) return INTERPRET_RUNTIME_ERROR;
+      }
+      NEXT; CASE(OP_ADD_CONSTANT_NUMBER):
+      {
+        // the constant is always a number, only the other side can change
+        value constant = READ_CONSTANT();
+        if (!IS_NUMBER(peek(0))) DESPECIALIZE(OP_ADD_CONSTANT, 2);
+        g_vm.stack_top[-1] = NUMBER_VAL(AS_NUMBER(peek(0)) + AS_NUMBER(constant));
+      }
+      NEXT; CASE(OP_EQUAL_NUMBER):
+      {
+        if (!NUMBERS(peek(0), peek(1))) DESPECIALIZE(OP_EQUAL, 1);
+        double b = AS_NUMBER(pop());
+        g_vm.stack_top[-1] = BOOL_VAL(AS_NUMBER(peek(0)) == b);
+      }
+      NEXT;
   }
 
+  return INTERPRET_RUNTIME_ERROR; // unreachable
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef ADD_OP
+#undef TRY_NATIVE
+#undef SAMPLE
+#undef DISPATCH_LOOP
+#undef CASE
+#undef NEXT
+#undef DESPECIALIZE
+#undef NUMBERS
 }
 
+// a script that runs out of heap unwinds back here from whatever
+// allocation failed. kept apart from interpret() so no local of the
+// caller lives across the setjmp
+static interpret_result run_script()
+{
+  jmp_buf handler;
+  if (setjmp(handler) != 0)
+  {
+    g_vm.heap_handler = NULL;
+    if (g_vm.heap_limit != 0)
+    {
+      runtime_error("Out of memory, the heap is limited to %zu bytes.", g_vm.heap_limit);
+    }
+    else
+    {
+      runtime_error("Out of memory.");
+    }
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  g_vm.heap_handler = &handler;
+  interpret_result result = run(0);
+  g_vm.heap_handler = NULL;
+  return result;
+}
+
+// compiling can't be unwound half way and isn't limited, a program that
+// is too big fails at its first allocation
 interpret_result interpret(const char* source)
 {
+  g_vm.limit_suspended++;
   obj_function* func = compile(source);
+  g_vm.limit_suspended--;
   if (func == NULL) 
   {
     return INTERPRET_COMPILE_ERROR;
@@ -343,7 +957,6 @@ interpret_result interpret(const char* source)
 
   push(OBJ_VAL(func));
   call(func, 0);
-
-  return run();
+  return run_script();
 }
 
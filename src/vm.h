@@ -1,6 +1,8 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
 #include "object.h"
 #include "chunk.h"
 #include "table.h"
@@ -15,14 +17,59 @@ typedef struct {
   value* slots;
 } call_frame;
 
+typedef enum {
+  GC_STOP_THE_WORLD,
+  GC_INCREMENTAL    // marks and sweeps gc_budget objects per allocation
+} gc_mode;
+
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING
+} gc_phase;
+
 typedef struct {
   call_frame frames[FRAMES_MAX];
   int frame_count;
   value stack[STACK_MAX];
   value* stack_top;
-  table globals;
+  table global_slots;
+  value_array global_names;
+  value_array global_values;
   table strings;
+  uint64_t hash_seed;   // mixed into every string hash
   obj* objects;
+  size_t bytes_allocated;
+  size_t next_gc;       // bytes_allocated that triggers the next collection
+  size_t heap_peak;
+  size_t heap_limit;    // 0 for no limit
+  int limit_suspended;  // > 0 while an allocation can't be unwound
+  jmp_buf* heap_handler; // where running out of heap unwinds to
+  int gray_count;
+  int gray_capacity;
+  obj** gray_stack;
+  gc_mode gc_mode;
+  gc_phase gc_phase;
+  size_t gc_budget;
+  obj* sweeping;        // objects the running cycle has yet to sweep
+  int strings_cursor;   // next entry of the string table to clear, -1 when done
+  uint32_t strings_generation; // of the string table when clearing started
+  uint64_t gc_cycles;
+  uint64_t minor_collections;
+  bool gc_stats;        // time every pause for --gc-stats
+#ifdef GENERATIONAL_GC
+  uint8_t* nursery;
+  uint8_t* nursery_top;
+  uint8_t* nursery_end;
+  obj** remembered;
+  int remembered_count;
+  int remembered_capacity;
+  int* remembered_globals;
+  int remembered_globals_count;
+  int remembered_globals_capacity;
+  bool* global_remembered; // one flag per slot of global_values
+#endif
+  bool jit_enabled; // only has an effect when built with CLOX_JIT
 } vm;
 
 typedef enum {
@@ -35,6 +82,8 @@ extern vm g_vm;
 
 void init_vm();
 void free_vm();
+void set_heap_limit(size_t bytes);
+int global_slot(obj_string* name);
 interpret_result interpret(const char* source);
 void push(value value);
 value pop();